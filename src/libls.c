@@ -0,0 +1,2530 @@
+/* libls.c
+ * Directory traversal behind ls(1); see libls.h for the interface.
+ *
+ * Listing runs as a pipeline connected by bounded SPSC queues:
+ *   reader   - opendir/readdir, finds subdirectories and walks depth-first
+ *   metadata - lstat of every entry (relative to the directory fd), sort
+ *   consumer - the caller, through ls_iter_next
+ * so the next directories are already being read while the current one
+ * is consumed. Batches leave the reader in depth-first order, which is the
+ * order they are handed out in.
+ * Several roots are walked concurrently by a bounded worker pool and
+ * handed out in argument order.
+ * With dir_timeout the calls that can hang on a dead mount run on helper
+ * threads under a deadline (see "deadlines").
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <limits.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+
+#include "libls.h"
+
+#define PIPE_DEPTH      16        /* batches in flight between two stages */
+#define ARENA_BLOCK     (16 * 1024)
+#define ROOT_WORKERS    8         /* roots walked concurrently */
+#define PAR_SORT_MIN    (1 << 16) /* entries before sorting goes parallel */
+#define THROTTLE_BURST  100000000 /* ns of unused rate that may be spent at once */
+#define COUNT_BUF       (64 * 1024) /* getdents buffer in count mode */
+#define SAMPLE_BUFFERS  4         /* estimate: default buffers read per directory */
+
+/* bounded single-producer/single-consumer queue */
+struct queue {
+    void **slots;
+    size_t cap, head, count;
+    int closed;
+    pthread_mutex_t mu;
+    pthread_cond_t not_empty, not_full;
+};
+
+/* top_k candidates, worst at the root; entries own their path in name */
+struct top_heap {
+    struct ls_entry *ents;
+    size_t count;
+};
+
+/* settings and counters shared by every walker of one listing */
+struct ls_ctx {
+    struct ls_options opt;      /* threads and fd_budget resolved */
+    struct ignore *hide;        /* opt.hide, compiled */
+    struct visited *visited;    /* follow_links */
+    struct throttle *throttle;  /* max_iops, max_dirs_per_sec */
+    uint32_t coll_tag;          /* collate: hash of the LC_COLLATE locale name */
+    time_t start_time;
+    atomic_int stop;            /* ls_iter_close before the end */
+    struct ls_stats totals;     /* guarded by totals_mu, like top */
+    struct top_heap top;        /* threads' heaps merged as they finish */
+    pthread_mutex_t totals_mu;
+};
+
+int ls_compare_names(const char *a, const char *b, int collate) {
+    int c = collate ? strcoll(a, b) : 0;
+    return c ? c : strcmp(a, b);
+}
+
+/* comparator for qsort over name strings */
+static int compare_names(const void *a, const void *b) {
+    const char *n1 = *(const char **)a;
+    const char *n2 = *(const char **)b;
+    return strcmp(n1, n2);
+}
+
+/* ... in LC_COLLATE order; only for the few subdirectory names per batch */
+static int compare_names_coll(const void *a, const void *b) {
+    return ls_compare_names(*(const char **)a, *(const char **)b, 1);
+}
+
+/* comparator for qsort over the entry table; all or none have sort keys */
+static int compare_entries(const void *a, const void *b) {
+    const struct ls_entry *e1 = a;
+    const struct ls_entry *e2 = b;
+    if (e1->sort_key) {
+        int c = strcmp(e1->sort_key, e2->sort_key);
+        if (c) return c;
+    }
+    return strcmp(e1->name, e2->name);
+}
+
+/* ... by name alone in LC_COLLATE order, for tables without keys */
+static int compare_entries_coll(const void *a, const void *b) {
+    return ls_compare_names(((const struct ls_entry *)a)->name, ((const struct ls_entry *)b)->name, 1);
+}
+
+char *ls_join_path(const char *dir, const char *name) {
+    size_t dl = strlen(dir), nl = strlen(name);
+    char *p = malloc(dl + nl + 2);
+    if (!p) return NULL;
+    memcpy(p, dir, dl);
+    p[dl] = '/';
+    memcpy(p + dl + 1, name, nl + 1);
+    return p;
+}
+
+/* ---------- arena ---------- */
+void *ls_arena_alloc(struct ls_arena *a, size_t n) {
+    struct ls_arena_block *b = a->head;
+    if (!b || b->cap - b->used < n) {
+        size_t cap = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof(*b) + cap);
+        if (!b) return NULL;
+        b->next = a->head;
+        b->used = 0;
+        b->cap = cap;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    return p;
+}
+
+char *ls_arena_strdup(struct ls_arena *a, const char *s, size_t len) {
+    char *p = ls_arena_alloc(a, len + 1);
+    if (!p) return NULL;
+    memcpy(p, s, len + 1);
+    return p;
+}
+
+void ls_arena_free(struct ls_arena *a) {
+    struct ls_arena_block *b = a->head;
+    while (b) {
+        struct ls_arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = NULL;
+}
+
+/* ---------- bounded queue ---------- */
+static int queue_init(struct queue *q, size_t cap) {
+    q->slots = calloc(cap, sizeof(void *));
+    if (!q->slots) return -1;
+    q->cap = cap;
+    q->head = q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->mu, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+static void queue_destroy(struct queue *q) {
+    pthread_mutex_destroy(&q->mu);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->slots);
+}
+
+static void queue_push(struct queue *q, void *item) {
+    pthread_mutex_lock(&q->mu);
+    while (q->count == q->cap)
+        pthread_cond_wait(&q->not_full, &q->mu);
+    q->slots[(q->head + q->count) % q->cap] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mu);
+}
+
+/* returns NULL once the producer has closed the queue and it is drained */
+static void *queue_pop(struct queue *q) {
+    pthread_mutex_lock(&q->mu);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->mu);
+    void *item = NULL;
+    if (q->count > 0) {
+        item = q->slots[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->mu);
+    return item;
+}
+
+static void queue_close(struct queue *q) {
+    pthread_mutex_lock(&q->mu);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->mu);
+}
+
+/* ---------- directory batches ---------- */
+/* a batch as allocated: the public ls_dir and what only the library uses */
+struct dir_batch {
+    struct ls_dir pub;
+    int dfd;
+    int have_dst;
+    struct stat dst;
+    int cached;
+    int pruned;                 /* ignore rules dropped entries: not cached */
+    void *map;
+    size_t map_len;
+    size_t cap;
+    struct ls_arena names;
+};
+
+#define BATCH(d)    ((struct dir_batch *)(void *)((char *)(d) - offsetof(struct dir_batch, pub)))
+
+static struct ls_dir *dir_new(char *path, int is_root) {
+    struct dir_batch *b = calloc(1, sizeof(*b));
+    if (!b) { free(path); return NULL; }
+    b->pub.path = path;
+    b->pub.is_root = is_root;
+    b->dfd = -1;
+    return &b->pub;
+}
+
+void ls_dir_free(struct ls_dir *d) {
+    if (!d) return;
+    struct dir_batch *b = BATCH(d);
+    if (b->dfd >= 0) close(b->dfd);
+    if (b->map) munmap(b->map, b->map_len);
+    ls_arena_free(&b->names);
+    free(d->ents);
+    free(d->path);
+    free(b);
+}
+
+static struct ls_entry *dir_add(struct ls_dir *d, const char *name, size_t len) {
+    struct dir_batch *b = BATCH(d);
+    if (d->count == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        struct ls_entry *tmp = realloc(d->ents, cap * sizeof(*tmp));
+        if (!tmp) return NULL;
+        d->ents = tmp;
+        b->cap = cap;
+    }
+    const char *copy = ls_arena_strdup(&b->names, name, len);
+    if (!copy) return NULL;
+    struct ls_entry *e = &d->ents[d->count++];
+    memset(e, 0, sizeof(*e));
+    e->name = copy;
+    e->name_len = len;
+    if (len > d->max_len) d->max_len = len;
+    return e;
+}
+
+struct ls_entry *ls_dir_copy_entries(const struct ls_dir *d, struct ls_arena *a) {
+    struct ls_entry *ents = ls_arena_alloc(a, (d->count ? d->count : 1) * sizeof(*ents));
+    if (!ents) return NULL;
+    for (size_t i = 0; i < d->count; ++i) {
+        ents[i] = d->ents[i];
+        ents[i].name = ls_arena_strdup(a, d->ents[i].name, d->ents[i].name_len);
+        ents[i].sort_key = NULL;
+        if (!ents[i].name) return NULL;
+    }
+    return ents;
+}
+
+/* ---------- filters ---------- */
+
+/* type tests first, then names, then whatever needs the stat result */
+static int pred_rank(enum ls_test t) {
+    return t == LS_TEST_TYPE ? 0 : t == LS_TEST_NAME ? 1 : 2;
+}
+
+int ls_filter_add(struct ls_filter *f, const struct ls_pred *p) {
+    struct ls_pred *tmp = realloc(f->preds, (f->count + 1) * sizeof(*tmp));
+    if (!tmp) return -1;
+    f->preds = tmp;
+    size_t at = f->count;
+    while (at > 0 && pred_rank(tmp[at - 1].test) > pred_rank(p->test)) {
+        tmp[at] = tmp[at - 1];
+        at--;
+    }
+    tmp[at] = *p;
+    f->count++;
+    if (pred_rank(p->test) < 2) f->ndirent++;
+    return 0;
+}
+
+void ls_filter_free(struct ls_filter *f) {
+    free(f->preds);
+    memset(f, 0, sizeof(*f));
+}
+
+/* 1 pass, 0 fail, -1 undecided: e is NULL before the stat, or it failed */
+static int pred_test(const struct ls_pred *p, const char *name, unsigned char d_type,
+                     const struct ls_entry *e) {
+    int have_st = e && !e->stat_err;
+    switch (p->test) {
+    case LS_TEST_NAME:
+        return fnmatch(p->glob, name, 0) == 0;
+    case LS_TEST_TYPE:
+        if (have_st) return (e->st.st_mode & S_IFMT) == p->type;
+        return d_type == DT_UNKNOWN ? -1 : (mode_t)DTTOIF(d_type) == p->type;
+    case LS_TEST_SIZE:
+        if (!have_st) return -1;
+        if (p->cmp < 0) return e->st.st_size < p->size;
+        if (p->cmp > 0) return e->st.st_size > p->size;
+        return e->st.st_size == p->size;
+    case LS_TEST_NEWER:
+        if (!have_st) return -1;
+        return e->st.st_mtim.tv_sec > p->time.tv_sec ||
+               (e->st.st_mtim.tv_sec == p->time.tv_sec && e->st.st_mtim.tv_nsec > p->time.tv_nsec);
+    }
+    return 1;
+}
+
+/* reader side: can this dirent still be listed? */
+static int filter_dirent(const struct ls_filter *f, const char *name, unsigned char d_type) {
+    for (size_t i = 0; i < f->ndirent; ++i)
+        if (pred_test(&f->preds[i], name, d_type, NULL) == 0) return 0;
+    return 1;
+}
+
+int ls_filter_match(const struct ls_filter *f, const struct ls_entry *e) {
+    for (size_t i = 0; i < f->count; ++i)
+        if (pred_test(&f->preds[i], e->name, e->d_type, e) == 0) return 0;
+    return 1;
+}
+
+/*
+ * Drop the entries of a stat'ed batch that fail a test. Entries whose stat
+ * failed stay, so the error is still reported.
+ */
+static void filter_batch(const struct ls_filter *f, struct ls_dir *d, int names_done) {
+    size_t kept = 0, max_len = 0;
+    for (size_t i = 0; i < d->count; ++i) {
+        const struct ls_entry *e = &d->ents[i];
+        int ok = 1;
+        for (size_t j = 0; ok && j < f->count; ++j) {
+            if (names_done && f->preds[j].test == LS_TEST_NAME) continue;
+            ok = pred_test(&f->preds[j], e->name, e->d_type, e) != 0;
+        }
+        if (!ok) continue;
+        if (e->name_len > max_len) max_len = e->name_len;
+        d->ents[kept++] = *e;
+    }
+    d->count = kept;
+    d->max_len = max_len;
+}
+
+/* ---------- ignore patterns ---------- */
+
+#define IGN_ANY         1         /* a pattern for any entry ends here */
+#define IGN_DIR         2         /* ... for directories only */
+#define GITIGNORE_MAX   (1 << 20) /* larger .gitignore files are not read */
+
+/* plain names share a trie; node 0 is the root */
+struct trie_node {
+    unsigned char c, flags;
+    uint32_t child, next;       /* first child, next sibling; 0: none */
+};
+
+struct ign_glob {
+    char *pat;
+    int dir_only, anchored;
+};
+
+/* one compiled set of rules: -I/--hide, or one .gitignore */
+struct ignore {
+    struct trie_node *trie;
+    size_t ntrie, trie_cap;
+    struct ign_glob *globs;
+    size_t nglobs, globs_cap;
+    int anchored;               /* some glob needs the relative path */
+    size_t base_len;            /* path_len of the directory the rules apply below */
+};
+
+static uint32_t trie_child(const struct ignore *ig, uint32_t n, unsigned char c) {
+    for (uint32_t k = ig->trie[n].child; k; k = ig->trie[k].next)
+        if (ig->trie[k].c == c) return k;
+    return 0;
+}
+
+static int trie_insert(struct ignore *ig, const char *name, size_t len, unsigned char flag) {
+    uint32_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)name[i];
+        uint32_t k = trie_child(ig, n, c);
+        if (!k) {
+            if (ig->ntrie == ig->trie_cap) {
+                size_t cap = ig->trie_cap * 2;
+                struct trie_node *tmp = realloc(ig->trie, cap * sizeof(*tmp));
+                if (!tmp) return -1;
+                ig->trie = tmp;
+                ig->trie_cap = cap;
+            }
+            k = (uint32_t)ig->ntrie++;
+            ig->trie[k] = (struct trie_node){ c, 0, 0, ig->trie[n].child };
+            ig->trie[n].child = k;
+        }
+        n = k;
+    }
+    ig->trie[n].flags |= flag;
+    return 0;
+}
+
+static struct ignore *ignore_new(size_t base_len) {
+    struct ignore *ig = calloc(1, sizeof(*ig));
+    if (!ig) return NULL;
+    ig->trie = calloc(16, sizeof(*ig->trie));
+    if (!ig->trie) { free(ig); return NULL; }
+    ig->ntrie = 1;
+    ig->trie_cap = 16;
+    ig->base_len = base_len;
+    return ig;
+}
+
+static void ignore_free(struct ignore *ig) {
+    if (!ig) return;
+    for (size_t i = 0; i < ig->nglobs; ++i) free(ig->globs[i].pat);
+    free(ig->globs);
+    free(ig->trie);
+    free(ig);
+}
+
+/* add one pattern of len bytes (not NUL-terminated) */
+static int ignore_add(struct ignore *ig, const char *pat, size_t len) {
+    int dir_only = len > 1 && pat[len - 1] == '/';
+    if (dir_only) len--;
+    if (len >= 3 && memcmp(pat, "**/", 3) == 0) { pat += 3; len -= 3; }
+    int anchored = memchr(pat, '/', len) != NULL;
+    if (anchored && pat[0] == '/') { pat++; len--; }
+    if (len == 0) return 0;
+
+    int wild = 0;
+    for (size_t i = 0; i < len && !wild; ++i) wild = strchr("*?[\\", pat[i]) != NULL;
+    if (!wild && !anchored) return trie_insert(ig, pat, len, dir_only ? IGN_DIR : IGN_ANY);
+
+    if (ig->nglobs == ig->globs_cap) {
+        size_t cap = ig->globs_cap ? ig->globs_cap * 2 : 8;
+        struct ign_glob *tmp = realloc(ig->globs, cap * sizeof(*tmp));
+        if (!tmp) return -1;
+        ig->globs = tmp;
+        ig->globs_cap = cap;
+    }
+    char *copy = malloc(len + 1);
+    if (!copy) return -1;
+    memcpy(copy, pat, len);
+    copy[len] = '\0';
+    ig->globs[ig->nglobs++] = (struct ign_glob){ copy, dir_only, anchored };
+    ig->anchored |= anchored;
+    return 0;
+}
+
+static struct ignore *ignore_compile(const char *const *pats, size_t n) {
+    struct ignore *ig = n ? ignore_new(0) : NULL;
+    for (size_t i = 0; ig && i < n; ++i)
+        if (ignore_add(ig, pats[i], strlen(pats[i])) != 0) { ignore_free(ig); ig = NULL; }
+    return ig;
+}
+
+/* .gitignore in the directory open on fd; NULL if there is none or it is empty */
+static struct ignore *ignore_load(int fd, size_t base_len) {
+    int gfd = openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+    if (gfd < 0) return NULL;
+    struct stat st;
+    char *buf = NULL;
+    ssize_t len = -1;
+    if (fstat(gfd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= GITIGNORE_MAX &&
+        (buf = malloc((size_t)st.st_size)) != NULL)
+        len = read(gfd, buf, (size_t)st.st_size);
+    close(gfd);
+
+    struct ignore *ig = len > 0 ? ignore_new(base_len) : NULL;
+    for (ssize_t pos = 0; ig && pos < len;) {
+        const char *line = buf + pos;
+        const char *nl = memchr(line, '\n', (size_t)(len - pos));
+        size_t ll = nl ? (size_t)(nl - line) : (size_t)(len - pos);
+        pos += (ssize_t)ll + 1;
+        while (ll > 0 && (line[ll - 1] == '\r' || line[ll - 1] == ' ')) ll--;
+        if (ll == 0 || line[0] == '#' || line[0] == '!') continue;
+        if (ignore_add(ig, line, ll) != 0) { ignore_free(ig); ig = NULL; }
+    }
+    free(buf);
+    if (ig && ig->ntrie == 1 && ig->nglobs == 0) { ignore_free(ig); ig = NULL; }
+    return ig;
+}
+
+/* name is the entry, rel its path below the rules' directory */
+static int ignore_match(const struct ignore *ig, const char *name, const char *rel, int is_dir) {
+    uint32_t n = 0;
+    for (const char *c = name; *c && (n = trie_child(ig, n, (unsigned char)*c)) != 0; ++c)
+        ;
+    if (n && (ig->trie[n].flags & IGN_ANY || (is_dir && ig->trie[n].flags & IGN_DIR))) return 1;
+    for (size_t i = 0; i < ig->nglobs; ++i) {
+        const struct ign_glob *g = &ig->globs[i];
+        if (g->dir_only && !is_dir) continue;
+        if (g->anchored ? rel && fnmatch(g->pat, rel, FNM_PATHNAME) == 0
+                        : fnmatch(g->pat, name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* ---------- inode sets ---------- */
+
+/* (dev, ino) pairs: counted hard links, walked directories */
+struct inode_set {
+    uint64_t *keys;             /* pairs; dev + 1 so that 0 marks a free slot */
+    size_t cap, count;
+};
+
+static int inode_set_add(struct inode_set *s, dev_t dev, ino_t ino) {
+    if (s->count * 2 >= s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 256;
+        uint64_t *keys = calloc(cap * 2, sizeof(uint64_t));
+        if (!keys) return 1;    /* count it again rather than fail */
+        for (size_t i = 0; i < s->cap; ++i) {
+            if (!s->keys[2 * i]) continue;
+            size_t j = (s->keys[2 * i] * 31 + s->keys[2 * i + 1]) * 0x9e3779b97f4a7c15ull % cap;
+            while (keys[2 * j]) j = (j + 1) % cap;
+            keys[2 * j] = s->keys[2 * i];
+            keys[2 * j + 1] = s->keys[2 * i + 1];
+        }
+        free(s->keys);
+        s->keys = keys;
+        s->cap = cap;
+    }
+    uint64_t k0 = (uint64_t)dev + 1, k1 = (uint64_t)ino;
+    size_t j = (k0 * 31 + k1) * 0x9e3779b97f4a7c15ull % s->cap;
+    for (; s->keys[2 * j]; j = (j + 1) % s->cap)
+        if (s->keys[2 * j] == k0 && s->keys[2 * j + 1] == k1) return 0;
+    s->keys[2 * j] = k0;
+    s->keys[2 * j + 1] = k1;
+    s->count++;
+    return 1;
+}
+
+#define VISIT_SHARDS    16        /* independently locked parts of the -L set */
+
+/* follow_links: directories already walked, shared by every walker */
+struct visited {
+    struct inode_set shard[VISIT_SHARDS];
+    pthread_mutex_t mu[VISIT_SHARDS];
+};
+
+static struct visited *visited_new(void) {
+    struct visited *v = calloc(1, sizeof(*v));
+    for (int i = 0; v && i < VISIT_SHARDS; ++i) pthread_mutex_init(&v->mu[i], NULL);
+    return v;
+}
+
+static void visited_free(struct visited *v) {
+    if (!v) return;
+    for (int i = 0; i < VISIT_SHARDS; ++i) {
+        free(v->shard[i].keys);
+        pthread_mutex_destroy(&v->mu[i]);
+    }
+    free(v);
+}
+
+/* 1 the first time a directory is seen, 0 when it was walked already */
+static int visited_add(struct visited *v, dev_t dev, ino_t ino) {
+    size_t i = (size_t)((((uint64_t)dev << 32) ^ (uint64_t)ino) * 0x9e3779b97f4a7c15ull >> 60) % VISIT_SHARDS;
+    pthread_mutex_lock(&v->mu[i]);
+    int fresh = inode_set_add(&v->shard[i], dev, ino);
+    pthread_mutex_unlock(&v->mu[i]);
+    return fresh;
+}
+
+/* ---------- deadlines ---------- */
+
+/*
+ * dir_timeout: the open/readdir and the stat'ing of a directory are handed
+ * to a helper thread as a job while the stage waits with a deadline. The
+ * job only touches memory and descriptors it owns, so when the deadline
+ * passes the stage abandons it: the helper is detached, frees the job
+ * with drop() whenever the stuck call returns, and the stage starts a new
+ * helper for its next directory. Without dir_timeout jobs run inline.
+ */
+struct helper {
+    pthread_t tid;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;          /* new job, job done, quit */
+    void (*fn)(void *);
+    void (*drop)(void *);
+    void *job;
+    int pending, done, abandoned, quit;
+};
+
+static void *helper_main(void *arg) {
+    struct helper *h = arg;
+    pthread_mutex_lock(&h->mu);
+    for (;;) {
+        while (!h->pending && !h->quit) pthread_cond_wait(&h->cv, &h->mu);
+        if (!h->pending) break;
+        pthread_mutex_unlock(&h->mu);
+        h->fn(h->job);
+        pthread_mutex_lock(&h->mu);
+        h->pending = 0;
+        h->done = 1;
+        if (h->abandoned) break;
+        pthread_cond_broadcast(&h->cv);
+    }
+    int abandoned = h->abandoned;
+    pthread_mutex_unlock(&h->mu);
+    if (abandoned) {
+        /* nobody refers to h any more */
+        h->drop(h->job);
+        pthread_cond_destroy(&h->cv);
+        pthread_mutex_destroy(&h->mu);
+        free(h);
+    }
+    return NULL;
+}
+
+static struct helper *helper_new(void) {
+    struct helper *h = calloc(1, sizeof(*h));
+    if (!h) return NULL;
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_mutex_init(&h->mu, NULL);
+    pthread_cond_init(&h->cv, &ca);
+    pthread_condattr_destroy(&ca);
+    if (pthread_create(&h->tid, NULL, helper_main, h) != 0) {
+        pthread_cond_destroy(&h->cv);
+        pthread_mutex_destroy(&h->mu);
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+static void helper_free(struct helper *h) {
+    if (!h) return;
+    pthread_mutex_lock(&h->mu);
+    h->quit = 1;
+    pthread_cond_broadcast(&h->cv);
+    pthread_mutex_unlock(&h->mu);
+    pthread_join(h->tid, NULL);
+    pthread_cond_destroy(&h->cv);
+    pthread_mutex_destroy(&h->mu);
+    free(h);
+}
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t t) {
+    struct timespec ts = { (time_t)(t / 1000000000), (long)(t % 1000000000) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Start of a directory's time: now + dir_timeout, plus wait ns the work is
+ * known to be held back by the throttle.
+ */
+static void deadline_set(const struct ls_ctx *ctx, struct timespec *ts, int64_t wait) {
+    if (!ctx->opt.dir_timeout) return;
+    int64_t t = now_ns() + wait + (int64_t)ctx->opt.dir_timeout * 1000000;
+    ts->tv_sec = (time_t)(t / 1000000000);
+    ts->tv_nsec = (long)(t % 1000000000);
+}
+
+/*
+ * fn(job) inline, or on *hp with a heap copy of the job (size bytes) under
+ * dir_timeout. 0 when it finished, with *job updated; -1 when the deadline
+ * passed, after which the copy belongs to the detached helper.
+ */
+static int run_job(const struct ls_ctx *ctx, struct helper **hp, const struct timespec *deadline,
+                   void (*fn)(void *), void (*drop)(void *), void *job, size_t size) {
+    void *copy;
+    if (!ctx->opt.dir_timeout || (!*hp && !(*hp = helper_new())) || !(copy = malloc(size))) {
+        fn(job);
+        return 0;
+    }
+    struct helper *h = *hp;
+    memcpy(copy, job, size);
+    pthread_mutex_lock(&h->mu);
+    h->fn = fn;
+    h->drop = drop;
+    h->job = copy;
+    h->done = 0;
+    h->pending = 1;
+    pthread_cond_broadcast(&h->cv);
+    int rc = 0;
+    while (!h->done && rc != ETIMEDOUT) rc = pthread_cond_timedwait(&h->cv, &h->mu, deadline);
+    if (!h->done) {
+        pthread_t tid = h->tid;
+        h->abandoned = 1;
+        pthread_mutex_unlock(&h->mu);
+        pthread_detach(tid);
+        *hp = NULL;
+        return -1;
+    }
+    pthread_mutex_unlock(&h->mu);
+    memcpy(job, copy, size);
+    free(copy);
+    return 0;
+}
+
+/* move the entry table (and its names, cache mapping and dfd) from one batch to another */
+static void dir_take(struct ls_dir *to, struct ls_dir *from) {
+    struct dir_batch *bt = BATCH(to), *bf = BATCH(from);
+    to->ents = from->ents;
+    to->count = from->count;
+    bt->cap = bf->cap;
+    to->max_len = from->max_len;
+    bt->names = bf->names;
+    bt->dfd = bf->dfd;
+    bt->map = bf->map;
+    bt->map_len = bf->map_len;
+    bt->cached = bf->cached;
+    memcpy(to->counts, from->counts, sizeof(to->counts));
+    from->ents = NULL;
+    from->count = bf->cap = from->max_len = 0;
+    bf->names.head = NULL;
+    bf->dfd = -1;
+    bf->map = NULL;
+    bf->cached = 0;
+}
+
+/* ---------- throttle ---------- */
+
+/*
+ * max_iops and max_dirs_per_sec: token buckets shared by all threads of a
+ * listing, each kept as the time its next token is due (GCRA). Taking n
+ * tokens reserves the next n slots and tells the caller when the first
+ * one starts; the slots are then used no faster than one per interval.
+ * Up to THROTTLE_BURST of rate left unused is available at once, so short
+ * pauses are not lost. A directory costs one dirs token and one iops
+ * token each for its open, its reads and every lstat.
+ */
+struct bucket {
+    int64_t interval;           /* ns per token, 0: unlimited */
+    int64_t next;               /* when the next token is due */
+};
+
+struct throttle {
+    pthread_mutex_t mu;
+    struct bucket iops, dirs;
+};
+
+static struct throttle *throttle_new(unsigned iops, unsigned dirs) {
+    if (!iops && !dirs) return NULL;
+    struct throttle *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    pthread_mutex_init(&t->mu, NULL);
+    t->iops.interval = iops ? 1000000000 / iops : 0;
+    t->dirs.interval = dirs ? 1000000000 / dirs : 0;
+    t->iops.next = t->dirs.next = now_ns();
+    return t;
+}
+
+static void throttle_free(struct throttle *t) {
+    if (!t) return;
+    pthread_mutex_destroy(&t->mu);
+    free(t);
+}
+
+/* reserve n tokens; when the first is due (now or earlier if there is slack) */
+static int64_t throttle_take(struct throttle *t, struct bucket *b, uint64_t n) {
+    int64_t now = now_ns();
+    if (!b->interval || !n) return now;
+    pthread_mutex_lock(&t->mu);
+    if (b->next < now - THROTTLE_BURST) b->next = now - THROTTLE_BURST;
+    int64_t start = b->next;
+    b->next += (int64_t)n * b->interval;
+    pthread_mutex_unlock(&t->mu);
+    return start;
+}
+
+/* take n tokens and sleep until the last of them is due */
+static void throttle_wait(struct throttle *t, struct bucket *b, uint64_t n) {
+    if (!b->interval || !n) return;
+    int64_t due = throttle_take(t, b, n) + (int64_t)(n - 1) * b->interval;
+    if (due > now_ns()) sleep_until(due);
+}
+
+/* ---------- stage 1: reader ---------- */
+
+/*
+ * Directories are stored one path component per node, each pointing at its
+ * parent, so a pending directory costs only its own name no matter how deep
+ * it is. Full paths are assembled only when a batch is created.
+ */
+struct dir_node {
+    struct dir_node *parent;
+    int refs;                   /* pending children, stack slot, fd cache */
+    int fd_slot;                /* index in the walker's fd cache, -1 if closed */
+    int was_cached;             /* had a cached fd at some point */
+    size_t depth;
+    size_t path_len;            /* strlen of the assembled path */
+    dev_t dev;                  /* one_fs: the root's filesystem */
+    struct ignore *ign;         /* rules from this directory's .gitignore */
+    const char *resume;         /* handed out before the resume point: what is left
+                                   of resume_after below here ("" at it), else NULL */
+    double weight;              /* estimate: directories this one stands for */
+    double child_weight;        /* ... and each of its subdirectories, once read */
+    char name[];                /* root node: the argument as given */
+};
+
+static struct dir_node *node_new(struct dir_node *parent, const char *name) {
+    size_t nl = strlen(name);
+    struct dir_node *n = malloc(sizeof(*n) + nl + 1);
+    if (!n) return NULL;
+    n->parent = parent;
+    n->refs = 1;
+    n->fd_slot = -1;
+    n->was_cached = 0;
+    n->ign = NULL;
+    n->resume = NULL;
+    n->weight = n->child_weight = parent ? parent->child_weight : 1;
+    n->dev = parent ? parent->dev : 0;
+    n->depth = parent ? parent->depth + 1 : 0;
+    n->path_len = parent ? parent->path_len + 1 + nl : nl;
+    memcpy(n->name, name, nl + 1);
+    if (parent) parent->refs++;
+    return n;
+}
+
+static void node_unref(struct dir_node *n) {
+    while (n && --n->refs == 0) {
+        struct dir_node *parent = n->parent;
+        ignore_free(n->ign);
+        free(n);
+        n = parent;
+    }
+}
+
+/* assemble "root/a/b/..." right to left; no PATH_MAX limit */
+static char *node_path(const struct dir_node *n) {
+    char *p = malloc(n->path_len + 1);
+    if (!p) return NULL;
+    size_t end = n->path_len;
+    p[end] = '\0';
+    for (; n; n = n->parent) {
+        size_t nl = strlen(n->name);
+        end -= nl;
+        memcpy(p + end, n->name, nl);
+        if (n->parent) p[--end] = '/';
+    }
+    return p;
+}
+
+/* one rule set against an entry of the directory at node, whose path is dir */
+static int rules_match(const struct ignore *ig, size_t base_len, const struct dir_node *node,
+                       const char *dir, const char *name, int is_dir) {
+    char buf[PATH_MAX], *rel = buf;
+    const char *r = name;
+    if (ig->anchored && node->path_len > base_len) {
+        /* paths past PATH_MAX are walked fd-relative, but dir still holds them whole */
+        size_t sub = node->path_len - base_len - 1, nl = strlen(name);
+        if (sub + 1 + nl >= sizeof(buf) && !(rel = malloc(sub + 1 + nl + 1))) return 0;
+        memcpy(rel, dir + base_len + 1, sub);
+        rel[sub] = '/';
+        memcpy(rel + sub + 1, name, nl + 1);
+        r = rel;
+    }
+    int rc = ignore_match(ig, name, r, is_dir);
+    if (rel != buf) free(rel);
+    return rc;
+}
+
+/* any ignore rules in force below node? */
+static int node_has_rules(const struct ls_ctx *ctx, const struct dir_node *node) {
+    if (ctx->hide) return 1;
+    for (; node; node = node->parent)
+        if (node->ign) return 1;
+    return 0;
+}
+
+/* is this entry of node's directory dropped by hide or a .gitignore on the way up? */
+static int node_ignores(const struct ls_ctx *ctx, const struct dir_node *node, const char *dir,
+                        const char *name, int is_dir) {
+    const struct dir_node *root = node;
+    for (const struct dir_node *n = node; n; n = n->parent) {
+        if (n->ign && rules_match(n->ign, n->ign->base_len, node, dir, name, is_dir)) return 1;
+        root = n;
+    }
+    return ctx->hide && rules_match(ctx->hide, root->path_len, node, dir, name, is_dir);
+}
+
+/* drop ignored entries from a table that came from the cache */
+static void ignore_batch(const struct ls_ctx *ctx, const struct dir_node *node, struct ls_dir *d) {
+    size_t kept = 0, max_len = 0;
+    for (size_t i = 0; i < d->count; ++i) {
+        const struct ls_entry *e = &d->ents[i];
+        int is_dir = e->stat_err ? e->d_type == DT_DIR : S_ISDIR(e->st.st_mode);
+        if (node_ignores(ctx, node, d->path, e->name, is_dir)) continue;
+        if (e->name_len > max_len) max_len = e->name_len;
+        d->ents[kept++] = *e;
+    }
+    d->count = kept;
+    d->max_len = max_len;
+}
+
+/* pending directories, popped in depth-first order */
+struct node_stack {
+    struct dir_node **nodes;
+    size_t count, cap;
+};
+
+static int stack_push(struct node_stack *s, struct dir_node *n) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 64;
+        struct dir_node **tmp = realloc(s->nodes, cap * sizeof(*tmp));
+        if (!tmp) return -1;
+        s->nodes = tmp;
+        s->cap = cap;
+    }
+    s->nodes[s->count++] = n;
+    return 0;
+}
+
+/*
+ * Descriptor budget: each walker keeps an LRU of open directory fds so
+ * children are opened with openat relative to their parent. When the
+ * budget is reached the least recently used fd is closed (directories with
+ * no pending children first); an evicted ancestor that is needed again is
+ * reopened by path, or from its nearest open ancestor when the path is
+ * longer than PATH_MAX. Budgets come from RLIMIT_NOFILE, so deep or wide
+ * walks never run into EMFILE.
+ */
+struct fd_slot {
+    struct dir_node *node;
+    int fd;
+    int prev, next;             /* LRU list, head = most recent */
+};
+
+struct fd_cache {
+    struct fd_slot *slots;
+    int budget, count;
+    int head, tail, free_slot;
+};
+
+/* scratch reused across walks by one reader */
+struct walker {
+    struct ls_ctx *ctx;
+    struct top_heap top;        /* when the walker also stats (root pool) */
+    struct helper *helper;      /* dir_timeout */
+    char *dbuf;                 /* count mode: getdents buffer */
+    struct node_stack stack;
+    const char **subdirs;
+    struct fd_cache fdc;
+    struct ls_stats stats;
+};
+
+#define WALKER_INIT(c) { .ctx = (c), .fdc = { .head = -1, .tail = -1 } }
+
+static void top_offer(const struct ls_ctx *ctx, struct top_heap *h, const struct ls_dir *d);
+static void top_merge(struct ls_ctx *ctx, struct top_heap *h);
+
+static void lru_unlink(struct fd_cache *c, int i) {
+    struct fd_slot *s = &c->slots[i];
+    if (s->prev >= 0) c->slots[s->prev].next = s->next; else c->head = s->next;
+    if (s->next >= 0) c->slots[s->next].prev = s->prev; else c->tail = s->prev;
+}
+
+static void lru_push_front(struct fd_cache *c, int i) {
+    struct fd_slot *s = &c->slots[i];
+    s->prev = -1;
+    s->next = c->head;
+    if (c->head >= 0) c->slots[c->head].prev = i;
+    c->head = i;
+    if (c->tail < 0) c->tail = i;
+}
+
+static int fdc_touch(struct fd_cache *c, struct dir_node *n) {
+    lru_unlink(c, n->fd_slot);
+    lru_push_front(c, n->fd_slot);
+    return c->slots[n->fd_slot].fd;
+}
+
+static void fdc_drop(struct walker *w, int i) {
+    struct fd_cache *c = &w->fdc;
+    struct fd_slot *s = &c->slots[i];
+    lru_unlink(c, i);
+    close(s->fd);
+    s->node->fd_slot = -1;
+    node_unref(s->node);
+    s->node = NULL;
+    s->next = c->free_slot;
+    c->free_slot = i;
+    c->count--;
+}
+
+/* take ownership of fd as n's cached descriptor */
+static void fdc_insert(struct walker *w, struct dir_node *n, int fd) {
+    struct fd_cache *c = &w->fdc;
+    if (fd < 0 || n->fd_slot >= 0) { if (fd >= 0) close(fd); return; }
+    if (!c->slots) {
+        int budget = w->ctx->opt.fd_budget;
+        c->slots = calloc((size_t)budget, sizeof(struct fd_slot));
+        if (!c->slots) { close(fd); return; }
+        c->budget = budget;
+        c->head = c->tail = -1;
+        c->free_slot = -1;
+        for (int i = c->budget; i-- > 0;) { c->slots[i].next = c->free_slot; c->free_slot = i; }
+    }
+    if (c->count == c->budget) {
+        /* prefer a directory nobody below will need again */
+        int victim = c->tail;
+        for (int i = c->tail; i >= 0; i = c->slots[i].prev)
+            if (c->slots[i].node->refs == 1) { victim = i; break; }
+        fdc_drop(w, victim);
+        w->stats.evictions++;
+    }
+    int i = c->free_slot;
+    c->free_slot = c->slots[i].next;
+    c->slots[i].node = n;
+    c->slots[i].fd = fd;
+    lru_push_front(c, i);
+    c->count++;
+    n->fd_slot = i;
+    n->was_cached = 1;
+    n->refs++;
+}
+
+/*
+ * The calls on a directory that may block on its filesystem: open (with
+ * fstat and .gitignore) and read. Everything a job uses is its own while
+ * it runs on a helper: base and name are copies there (owned).
+ */
+struct dir_job {
+    int base;                   /* open name relative to this, or AT_FDCWD */
+    const char *name;
+    int owned;                  /* base and name belong to the job */
+    int flags;                  /* open flags */
+    int load_ignore;            /* read .gitignore, rules based at ign_base */
+    size_t ign_base;
+    int fd, err, have_st;       /* open: the directory, or errno */
+    struct stat st;
+    struct ignore *ign;
+    struct ls_dir *d;           /* read: entries, and dfd, go here */
+    int want_type, want_dev;    /* read: stat entries to tell directories, devices */
+    int stat_flags;
+    size_t nstat;               /* read: those entries */
+    int count_only;             /* count: add only possible directories to d */
+    char *buf;                  /* count: getdents buffer, */
+    int own_buf;                /* ... the job's own on a helper */
+    size_t sample;              /* estimate: buffers to read, 0: all */
+    int sampled;                /* ... stopped before the end */
+    long fs_type;               /* ... f_type of the filesystem */
+    uint64_t seen, name_bytes, rec_bytes; /* ... names read, incl. hidden */
+};
+
+static void job_release(struct dir_job *j) {
+    if (!j->owned) return;
+    if (j->base >= 0) close(j->base);
+    free((char *)j->name);
+    j->owned = 0;
+}
+
+static void job_drop(void *arg) {
+    struct dir_job *j = arg;
+    job_release(j);
+    if (j->fd >= 0) close(j->fd);
+    ignore_free(j->ign);
+    ls_dir_free(j->d);
+    if (j->own_buf) free(j->buf);
+    free(j);
+}
+
+static void job_open(void *arg) {
+    struct dir_job *j = arg;
+    j->fd = openat(j->base, j->name, j->flags);
+    if (j->fd < 0) { j->err = errno; return; }
+    j->have_st = fstat(j->fd, &j->st) == 0;
+    if (j->load_ignore) j->ign = ignore_load(j->fd, j->ign_base);
+}
+
+/*
+ * One name from the directory open on dfd, skipping hidden names. Entries
+ * whose type matters but is not in d_type (want_type), or directories
+ * whose device matters (want_dev), are also stat'ed; st_mode stays 0 where
+ * that did not happen. With count_only, entries that cannot be
+ * directories, or all when nothing is descended into, are only tallied.
+ * -1 when out of memory.
+ */
+static int job_entry(struct dir_job *j, int dfd, const char *name, ino_t ino, unsigned char d_type) {
+    if (name[0] == '.') return 0; /* skip hidden */
+    int unknown = d_type == DT_UNKNOWN || (d_type == DT_LNK && j->stat_flags == 0);
+    if (j->count_only && (!j->want_type || (!unknown && d_type != DT_DIR))) {
+        j->d->counts[d_type & 15]++;
+        return 0;
+    }
+    struct ls_entry *e = dir_add(j->d, name, strlen(name));
+    if (!e) return -1;
+    e->ino = ino;
+    e->d_type = d_type;
+    if ((j->want_type && unknown) || (j->want_dev && (unknown || d_type == DT_DIR))) {
+        if (fstatat(dfd, e->name, &e->st, j->stat_flags) != 0) e->st.st_mode = 0;
+        j->nstat++;
+    }
+    return 0;
+}
+
+/* readdir into j->d */
+static void job_read(void *arg) {
+    struct dir_job *j = arg;
+    DIR *dp = fdopendir(j->fd);
+    if (!dp) { j->err = errno; return; }
+    j->fd = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dp)) != NULL)
+        if (job_entry(j, dirfd(dp), entry->d_name, entry->d_ino, entry->d_type) != 0) break;
+    BATCH(j->d)->dfd = dup(dirfd(dp));
+    closedir(dp);
+}
+
+/*
+ * Count mode: the raw getdents64 records straight from the buffer, with
+ * nothing allocated or stat'ed for entries that cannot be directories.
+ * With sample set, stop after that many buffers and note what was seen for
+ * the extrapolation (see estimate_entries).
+ */
+static void job_count(void *arg) {
+#ifdef SYS_getdents64
+    struct dir_job *j = arg;
+    struct dirent64_rec {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    if (j->sample) {
+        struct statfs sfs;
+        j->fs_type = fstatfs(j->fd, &sfs) == 0 ? (long)sfs.f_type : 0;
+    }
+    for (size_t nbuf = 0;; ++nbuf) {
+        if (j->sample && nbuf == j->sample) { j->sampled = 1; break; }
+        long n = syscall(SYS_getdents64, j->fd, j->buf, COUNT_BUF);
+        if (n <= 0) {
+            if (n < 0) j->err = errno;
+            break;
+        }
+        for (long off = 0; off < n;) {
+            const struct dirent64_rec *r = (const struct dirent64_rec *)(j->buf + off);
+            off += r->d_reclen;
+            if (r->d_name[0] == '.' && (!r->d_name[1] || (r->d_name[1] == '.' && !r->d_name[2]))) continue;
+            if (j->sample) {
+                size_t len = strlen(r->d_name);
+                j->seen++;
+                j->name_bytes += len;
+                j->rec_bytes += 8 + ((len + 3) & ~(size_t)3);
+            }
+            if (job_entry(j, j->fd, r->d_name, (ino_t)r->d_ino, r->d_type) != 0) { n = 0; break; }
+        }
+    }
+    BATCH(j->d)->dfd = j->fd;
+    j->fd = -1;
+#else
+    /* no raw getdents: count through readdir, without sampling */
+    ((struct dir_job *)arg)->sample = 0;
+    job_read(arg);
+#endif
+}
+
+/*
+ * estimate: entries in a directory of size bytes, from what a sample says
+ * about the space one takes there. tmpfs charges BOGO_DIRENT_SIZE (20) per
+ * entry and btrfs twice the name length; ext2/3/4 and filesystems like
+ * them store 8 bytes plus the name rounded up to 4 per record, in hashed
+ * directory blocks that are about three quarters full.
+ */
+#define TMPFS_FS_MAGIC  0x01021994
+#define BTRFS_FS_MAGIC  0x9123683e
+
+static double estimate_entries(const struct dir_job *j, off_t size) {
+    if (!j->seen) return 0;
+    double per;
+    switch ((unsigned long)j->fs_type) {
+    case TMPFS_FS_MAGIC: per = 20; break;
+    case BTRFS_FS_MAGIC: per = 2.0 * (double)j->name_bytes / (double)j->seen; break;
+    default: per = (double)j->rec_bytes / (double)j->seen / 0.75; break;
+    }
+    return per > 0 ? (double)size / per : 0;
+}
+
+/* open name under base as job j, with copies of both under dir_timeout */
+static int open_job(struct walker *w, struct dir_job *j, int base, const char *name, int flags,
+                    const struct timespec *deadline) {
+    j->base = base;
+    j->name = name;
+    j->flags = flags;
+    j->fd = -1;
+    if (w->ctx->opt.dir_timeout) {
+        j->base = base == AT_FDCWD ? AT_FDCWD : dup(base);
+        j->name = strdup(name);
+        j->owned = 1;
+        if (!j->name || j->base == -1) {
+            j->err = errno;
+            job_release(j);
+            return 0;
+        }
+    }
+    int rc = run_job(w->ctx, &w->helper, deadline, job_open, job_drop, j, sizeof(*j));
+    if (rc == 0) job_release(j);
+    return rc;
+}
+
+/*
+ * Cached fd for n, reopening it (and ancestors past PATH_MAX) if needed,
+ * each open under the deadline like any other. The fd stays owned by the
+ * cache; -1 with errno set, -2 when an open missed the deadline.
+ */
+static int fdc_get(struct walker *w, struct dir_node *n, const struct timespec *deadline) {
+    if (n->fd_slot >= 0) return fdc_touch(&w->fdc, n);
+
+    size_t steps = 0;
+    struct dir_node *base = n;
+    while (base->fd_slot < 0 && base->path_len >= PATH_MAX && base->parent) {
+        base = base->parent;
+        ++steps;
+    }
+
+    int fd;
+    if (base->fd_slot >= 0) {
+        fd = fdc_touch(&w->fdc, base);
+    } else {
+        if (base->path_len >= PATH_MAX) { errno = ENAMETOOLONG; return -1; }
+        char *path = node_path(base);
+        if (!path) return -1;
+        struct dir_job j = { .fd = -1 };
+        int rc = open_job(w, &j, AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, deadline);
+        free(path);
+        if (rc != 0) return -2;
+        if (j.fd < 0) { errno = j.err; return -1; }
+        fd = j.fd;
+        if (base->was_cached) w->stats.reopens++;
+        fdc_insert(w, base, fd);
+    }
+
+    struct dir_node **chain = malloc((steps ? steps : 1) * sizeof(*chain));
+    if (!chain) return -1;
+    size_t i = steps;
+    for (struct dir_node *c = n; c != base; c = c->parent) chain[--i] = c;
+    int nofollow = w->ctx->opt.follow_links ? 0 : O_NOFOLLOW;
+    for (i = 0; i < steps && fd >= 0; ++i) {
+        struct dir_job j = { .fd = -1 };
+        if (open_job(w, &j, fd, chain[i]->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | nofollow, deadline) != 0) {
+            fd = -2;
+            break;
+        }
+        if (j.fd < 0) { errno = j.err; fd = -1; break; }
+        if (chain[i]->was_cached) w->stats.reopens++;
+        fdc_insert(w, chain[i], j.fd);
+        fd = j.fd;
+    }
+    free(chain);
+    return fd;
+}
+
+/*
+ * Open n for reading: j->fd, owned by the caller, or j->err. -1 when the
+ * deadline passed first.
+ */
+static int walker_open_dir(struct walker *w, struct dir_node *n, const char *path, struct dir_job *j,
+                           const struct timespec *deadline) {
+    const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    int nofollow = w->ctx->opt.follow_links ? 0 : O_NOFOLLOW;
+    struct dir_node *p = n->parent;
+    int rc;
+    w->stats.opens++;
+    if (p && p->fd_slot >= 0) {
+        w->stats.relative++;
+        rc = open_job(w, j, fdc_touch(&w->fdc, p), n->name, flags | nofollow, deadline);
+    } else if (n->path_len < PATH_MAX) {
+        if (p && p->was_cached) w->stats.reopens++;
+        rc = open_job(w, j, AT_FDCWD, path, flags, deadline);
+    } else {
+        int pfd = fdc_get(w, p, deadline);
+        if (pfd == -2) return -1;
+        if (pfd < 0) { j->fd = -1; j->err = errno; return 0; }
+        rc = open_job(w, j, pfd, n->name, flags | nofollow, deadline);
+    }
+    if (rc == 0 && j->fd < 0 && (j->err == EMFILE || j->err == ENFILE) && w->fdc.count > 0) {
+        /* someone else is using descriptors: give ours back and retry by path */
+        while (w->fdc.head >= 0) fdc_drop(w, w->fdc.head);
+        w->stats.evictions++;
+        if (n->path_len < PATH_MAX) rc = open_job(w, j, AT_FDCWD, path, flags, deadline);
+    }
+    return rc;
+}
+
+static void walker_free(struct walker *w) {
+    helper_free(w->helper);
+    free(w->dbuf);
+    while (w->fdc.head >= 0 && w->fdc.slots) fdc_drop(w, w->fdc.head);
+    free(w->fdc.slots);
+    for (size_t i = 0; i < w->stack.count; ++i) node_unref(w->stack.nodes[i]);
+    free(w->stack.nodes);
+    free(w->subdirs);
+    top_merge(w->ctx, &w->top);
+
+    struct ls_stats *t = &w->ctx->totals;
+    pthread_mutex_lock(&w->ctx->totals_mu);
+    t->opens += w->stats.opens;
+    t->relative += w->stats.relative;
+    t->evictions += w->stats.evictions;
+    t->reopens += w->stats.reopens;
+    t->cache_hits += w->stats.cache_hits;
+    t->cache_misses += w->stats.cache_misses;
+    t->timeouts += w->stats.timeouts;
+    pthread_mutex_unlock(&w->ctx->totals_mu);
+}
+
+/*
+ * Snapshot cache (cache_dir): every listed directory's sorted entry table
+ * is stored as "<dev>-<ino>.lsc" under it: a header, fixed-size records and
+ * a blob of NUL-terminated names, so it can be mmap'ed and used in place.
+ * A snapshot is reused only while the directory's inode, mtime and ctime
+ * are unchanged; otherwise the directory is read and stat'ed again and the
+ * snapshot rewritten. Entry metadata is taken from the snapshot as is, so
+ * a file rewritten in place shows its old size until its directory changes.
+ */
+#define CACHE_MAGIC     0x3143534cu     /* "LSC1" */
+#define CACHE_VERSION   1
+
+struct cache_header {
+    uint32_t magic, version;
+    uint32_t rec_size, pad;
+    uint64_t dev, ino;
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint64_t count, names_size;
+};
+
+/* entry <-> on-disk record, shared by the cache and snapshots */
+void ls_rec_from_entry(struct ls_rec *r, const struct ls_entry *e, uint32_t name_off) {
+    memset(r, 0, sizeof(*r));
+    r->dev = (uint64_t)e->st.st_dev;
+    r->ino = (uint64_t)(e->stat_err ? e->ino : e->st.st_ino);
+    r->rdev = (uint64_t)e->st.st_rdev;
+    r->size = (uint64_t)e->st.st_size;
+    r->blocks = (uint64_t)e->st.st_blocks;
+    r->blksize = (uint32_t)e->st.st_blksize;
+    r->atime_sec = e->st.st_atim.tv_sec;
+    r->atime_nsec = e->st.st_atim.tv_nsec;
+    r->mtime_sec = e->st.st_mtim.tv_sec;
+    r->mtime_nsec = e->st.st_mtim.tv_nsec;
+    r->ctime_sec = e->st.st_ctim.tv_sec;
+    r->ctime_nsec = e->st.st_ctim.tv_nsec;
+    r->mode = (uint32_t)e->st.st_mode;
+    r->nlink = (uint32_t)e->st.st_nlink;
+    r->uid = (uint32_t)e->st.st_uid;
+    r->gid = (uint32_t)e->st.st_gid;
+    r->name_off = name_off;
+    r->name_len = (uint32_t)e->name_len;
+    r->stat_err = e->stat_err;
+    r->d_type = e->d_type;
+}
+
+void ls_entry_from_rec(struct ls_entry *e, const struct ls_rec *r, const char *names) {
+    memset(e, 0, sizeof(*e));
+    e->name = names + r->name_off;
+    e->name_len = r->name_len;
+    e->ino = (ino_t)r->ino;
+    e->d_type = r->d_type;
+    e->stat_err = r->stat_err;
+    e->st.st_dev = (dev_t)r->dev;
+    e->st.st_ino = (ino_t)r->ino;
+    e->st.st_rdev = (dev_t)r->rdev;
+    e->st.st_size = (off_t)r->size;
+    e->st.st_blocks = (blkcnt_t)r->blocks;
+    e->st.st_blksize = (blksize_t)r->blksize;
+    e->st.st_mode = (mode_t)r->mode;
+    e->st.st_nlink = (nlink_t)r->nlink;
+    e->st.st_uid = (uid_t)r->uid;
+    e->st.st_gid = (gid_t)r->gid;
+    e->st.st_atim.tv_sec = (time_t)r->atime_sec;
+    e->st.st_atim.tv_nsec = (long)r->atime_nsec;
+    e->st.st_mtim.tv_sec = (time_t)r->mtime_sec;
+    e->st.st_mtim.tv_nsec = (long)r->mtime_nsec;
+    e->st.st_ctim.tv_sec = (time_t)r->ctime_sec;
+    e->st.st_ctim.tv_nsec = (long)r->ctime_nsec;
+}
+
+int ls_rec_name_ok(const struct ls_rec *r, const char *names, uint64_t names_size) {
+    return (uint64_t)r->name_off + r->name_len < names_size &&
+           names[r->name_off + r->name_len] == '\0';
+}
+
+static char *cache_file(const struct ls_ctx *ctx, const struct stat *dst) {
+    size_t len = strlen(ctx->opt.cache_dir) + 64;
+    char *p = malloc(len);
+    /* tables stat'ed through symlinks or sorted for a locale are kept apart */
+    char coll[16] = "";
+    if (ctx->opt.collate) snprintf(coll, sizeof(coll), "-%08x", ctx->coll_tag);
+    if (p) snprintf(p, len, "%s/%llx-%llx%s%s.lsc", ctx->opt.cache_dir,
+                    (unsigned long long)dst->st_dev, (unsigned long long)dst->st_ino,
+                    ctx->opt.follow_links ? "-L" : "", coll);
+    return p;
+}
+
+static int cache_matches(const struct cache_header *h, const struct stat *dst) {
+    return h->magic == CACHE_MAGIC && h->version == CACHE_VERSION &&
+           h->rec_size == sizeof(struct ls_rec) &&
+           h->dev == (uint64_t)dst->st_dev && h->ino == (uint64_t)dst->st_ino &&
+           h->mtime_sec == (int64_t)dst->st_mtim.tv_sec &&
+           h->mtime_nsec == (int64_t)dst->st_mtim.tv_nsec &&
+           h->ctime_sec == (int64_t)dst->st_ctim.tv_sec &&
+           h->ctime_nsec == (int64_t)dst->st_ctim.tv_nsec;
+}
+
+/* fill d from the snapshot at path if it matches d's dst; returns 0 on a hit */
+static int cache_load(const char *path, struct ls_dir *d) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat fst;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &fst) == 0 && (size_t)fst.st_size >= sizeof(struct cache_header))
+        map = mmap(NULL, (size_t)fst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    size_t len = (size_t)fst.st_size;
+
+    const struct cache_header *h = map;
+    const struct ls_rec *recs = (const void *)(h + 1);
+    if (!cache_matches(h, &BATCH(d)->dst) || h->count > len / sizeof(struct ls_rec) ||
+        sizeof(*h) + h->count * sizeof(struct ls_rec) + h->names_size != len)
+        goto bad;
+    const char *names = (const char *)(recs + h->count);
+
+    d->ents = malloc((h->count ? h->count : 1) * sizeof(struct ls_entry));
+    if (!d->ents) goto bad;
+    for (size_t i = 0; i < h->count; ++i) {
+        if (!ls_rec_name_ok(&recs[i], names, h->names_size)) goto bad;
+        struct ls_entry *e = &d->ents[i];
+        ls_entry_from_rec(e, &recs[i], names);
+        if (e->name_len > d->max_len) d->max_len = e->name_len;
+    }
+    struct dir_batch *b = BATCH(d);
+    d->count = b->cap = h->count;
+    b->map = map;
+    b->map_len = len;
+    b->cached = 1;
+    return 0;
+
+bad:
+    free(d->ents);
+    d->ents = NULL;
+    d->max_len = 0;
+    munmap(map, len);
+    return -1;
+}
+
+/*
+ * cache_load as a job: the cache can sit on a mount as slow as the tree,
+ * so it gets the deadline too. It loads into a husk of its own (with dst
+ * set) and needs nothing from the walk that might be gone if it is
+ * abandoned.
+ */
+struct cache_job {
+    char *path;
+    struct ls_dir *d;
+    int rc;
+};
+
+static void job_cache(void *arg) {
+    struct cache_job *j = arg;
+    j->rc = cache_load(j->path, j->d);
+}
+
+static void job_cache_drop(void *arg) {
+    struct cache_job *j = arg;
+    free(j->path);
+    ls_dir_free(j->d);
+    free(j);
+}
+
+/* write d's sorted table; called by the metadata stage after stat */
+static void cache_store(const struct ls_ctx *ctx, const struct ls_dir *d) {
+    const struct stat *dst = &BATCH(d)->dst;
+    /* a directory changed within the timestamp granularity could change
+     * again without its mtime moving: leave it uncached this run */
+    if (dst->st_mtime >= ctx->start_time - 1 || dst->st_ctime >= ctx->start_time - 1) return;
+
+    struct cache_header h = { 0 };
+    h.magic = CACHE_MAGIC;
+    h.version = CACHE_VERSION;
+    h.rec_size = sizeof(struct ls_rec);
+    h.dev = (uint64_t)dst->st_dev;
+    h.ino = (uint64_t)dst->st_ino;
+    h.mtime_sec = (int64_t)dst->st_mtim.tv_sec;
+    h.mtime_nsec = (int64_t)dst->st_mtim.tv_nsec;
+    h.ctime_sec = (int64_t)dst->st_ctim.tv_sec;
+    h.ctime_nsec = (int64_t)dst->st_ctim.tv_nsec;
+    h.count = d->count;
+    for (size_t i = 0; i < d->count; ++i) h.names_size += d->ents[i].name_len + 1;
+
+    size_t len = sizeof(h) + d->count * sizeof(struct ls_rec) + h.names_size;
+    char *buf = malloc(len);
+    if (!buf) return;
+    memcpy(buf, &h, sizeof(h));
+    struct ls_rec *recs = (struct ls_rec *)(buf + sizeof(h));
+    char *names = (char *)(recs + d->count);
+    uint32_t off = 0;
+    for (size_t i = 0; i < d->count; ++i) {
+        const struct ls_entry *e = &d->ents[i];
+        struct ls_rec r;
+        ls_rec_from_entry(&r, e, off);
+        memcpy(&recs[i], &r, sizeof(r));
+        memcpy(names + off, e->name, e->name_len + 1);
+        off += (uint32_t)e->name_len + 1;
+    }
+
+    char *path = cache_file(ctx, dst);
+    size_t tlen = path ? strlen(path) + 48 : 0;
+    char *tmp = path ? malloc(tlen) : NULL;
+    if (tmp) {
+        /* unique per process and batch, then renamed into place atomically */
+        snprintf(tmp, tlen, "%s.%ld.%lx", path, (long)getpid(), (unsigned long)(uintptr_t)d);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            ssize_t n = write(fd, buf, len);
+            close(fd);
+            if (n != (ssize_t)len || rename(tmp, path) != 0) unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(path);
+    free(buf);
+}
+
+/* per-directory share of the tree totals, summed where the batch is filled */
+static void sum_blocks(struct ls_dir *d) {
+    blkcnt_t sum = 0;
+    for (size_t i = 0; i < d->count; ++i)
+        if (!d->ents[i].stat_err) sum += d->ents[i].st.st_blocks;
+    d->blocks = sum;
+}
+
+static void add_subdir(const char ***subdirs, size_t *nsub, size_t *cap, const char *name) {
+    if (*nsub == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 16;
+        const char **tmp = realloc(*subdirs, ncap * sizeof(char *));
+        if (!tmp) return;
+        *subdirs = tmp;
+        *cap = ncap;
+    }
+    (*subdirs)[(*nsub)++] = name;
+}
+
+/*
+ * Count mode: the batch keeps only its tallies. A sampled directory's are
+ * scaled up to the estimated whole, and each subdirectory found in the
+ * sample stands for that many times as many (its weight), so a tree sum
+ * over count * weight estimates the unread subtrees too (Knuth's
+ * estimator).
+ */
+static void count_finish(struct ls_dir *d, struct dir_node *node, const struct dir_job *j) {
+    d->count = 0;
+    d->max_len = 0;
+    d->weight = node->weight;
+    if (!j->sampled || !j->have_st) return;
+    double scale = estimate_entries(j, j->st.st_size) / (double)j->seen;
+    if (!(scale > 1)) return;
+    for (int t = 0; t < 16; ++t) d->counts[t] = (uint64_t)((double)d->counts[t] * scale + 0.5);
+    d->estimated = 1;
+    node->child_weight = node->weight * scale;
+}
+
+/*
+ * Read one directory into a batch. Subdirectory names (d_type, or an lstat
+ * when the filesystem does not report it) are appended to *subdirs so the
+ * caller can continue the walk without waiting for the later stages.
+ * Returns -1, with nothing read, for a directory already walked (-L).
+ * A directory that misses dir_timeout gets ETIMEDOUT and no entries.
+ */
+static int read_dir_batch(struct walker *w, struct ls_dir *d, struct dir_node *node,
+                           const char ***subdirs, size_t *nsub) {
+    const struct ls_ctx *ctx = w->ctx;
+    size_t subcap = 0;
+    struct timespec deadline;
+    if (ctx->throttle) {
+        /* one directory; its open and first read */
+        throttle_wait(ctx->throttle, &ctx->throttle->dirs, 1);
+        throttle_wait(ctx->throttle, &ctx->throttle->iops, 2);
+    }
+    deadline_set(ctx, &deadline, 0);
+
+    struct dir_job job = { .fd = -1 };
+    job.load_ignore = ctx->opt.gitignore && !node->ign;
+    job.ign_base = node->path_len;
+    if (walker_open_dir(w, node, d->path, &job, &deadline) != 0) goto timed_out;
+    if (job.fd < 0) {
+        d->err = job.err;
+        return 0;
+    }
+    int fd = job.fd;
+    if (job.ign) { node->ign = job.ign; job.ign = NULL; }
+
+    int ignoring = node_has_rules(ctx, node);
+    /* depth and filesystem limits are applied here, so nothing beyond them is opened */
+    int descend = ctx->opt.recursive && (!ctx->opt.max_depth || node->depth < ctx->opt.max_depth);
+    if (job.have_st) {
+        if (!node->parent) node->dev = job.st.st_dev;
+        /*
+         * Checked when the directory is reached in walk order, so the
+         * first path to it by name wins; each physical directory is read
+         * once, which also ends link cycles. Roots are always listed.
+         */
+        if (ctx->visited && !visited_add(ctx->visited, job.st.st_dev, job.st.st_ino) && node->parent) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (ctx->opt.cache_dir && !ctx->opt.count && job.have_st) {
+        BATCH(d)->dst = job.st;
+        BATCH(d)->have_dst = 1;
+        struct cache_job cj = { cache_file(ctx, &job.st), dir_new(NULL, 0), -1 };
+        if (cj.path && cj.d) {
+            BATCH(cj.d)->dst = job.st;
+            if (run_job(ctx, &w->helper, &deadline, job_cache, job_cache_drop, &cj, sizeof(cj)) != 0) {
+                close(fd);
+                goto timed_out;
+            }
+            if (cj.rc == 0) dir_take(d, cj.d);
+        }
+        free(cj.path);
+        ls_dir_free(cj.d);
+        if (cj.rc == 0) {
+            w->stats.cache_hits++;
+            if (ignoring) ignore_batch(ctx, node, d);
+            for (size_t i = 0; descend && i < d->count; ++i) {
+                const struct ls_entry *e = &d->ents[i];
+                if (!e->stat_err && S_ISDIR(e->st.st_mode) && (!ctx->opt.one_fs || e->st.st_dev == node->dev))
+                    add_subdir(subdirs, nsub, &subcap, e->name);
+            }
+            if (ctx->opt.filter) filter_batch(ctx->opt.filter, d, 0);
+            sum_blocks(d);
+            if (*nsub > 0) fdc_insert(w, node, fd);
+            else close(fd);
+            return 0;
+        }
+        w->stats.cache_misses++;
+    }
+
+    job.d = dir_new(NULL, 0);
+    if (!job.d) {
+        d->err = errno;
+        close(fd);
+        return 0;
+    }
+    job.want_type = descend || ignoring;
+    job.want_dev = descend && ctx->opt.one_fs;
+    job.stat_flags = ctx->opt.follow_links ? 0 : AT_SYMLINK_NOFOLLOW;
+    if (ctx->opt.count) {
+        /* ignore rules need every name, so then all are kept and tallied below */
+        job.count_only = !ignoring;
+        if (ctx->opt.count == LS_COUNT_ESTIMATE)
+            job.sample = ctx->opt.sample_buffers ? ctx->opt.sample_buffers : SAMPLE_BUFFERS;
+        if (ctx->opt.dir_timeout) {
+            job.buf = malloc(COUNT_BUF);
+            job.own_buf = 1;
+        } else {
+            if (!w->dbuf) w->dbuf = malloc(COUNT_BUF);
+            job.buf = w->dbuf;
+        }
+        if (!job.buf) {
+            d->err = ENOMEM;
+            ls_dir_free(job.d);
+            close(fd);
+            return 0;
+        }
+    }
+    if (run_job(ctx, &w->helper, &deadline, ctx->opt.count ? job_count : job_read, job_drop, &job,
+                sizeof(job)) != 0)
+        goto timed_out;
+    if (job.own_buf) free(job.buf);
+    dir_take(d, job.d);
+    ls_dir_free(job.d);
+    /* charged afterwards: further reads (a getdents per ~32K) and the lstats */
+    if (ctx->throttle) throttle_take(ctx->throttle, &ctx->throttle->iops, d->count / 512 + job.nstat);
+    if (job.err && ctx->opt.count) d->err = job.err; /* getdents failed: counts are partial */
+    if (job.fd >= 0) {
+        /* fdopendir failed */
+        d->err = job.err;
+        close(job.fd);
+        return 0;
+    }
+
+    /* with a cache the table is stored whole and filtered afterwards */
+    const struct ls_filter *filter = ctx->opt.cache_dir ? NULL : ctx->opt.filter;
+    size_t kept = 0, max_len = 0;
+    for (size_t i = 0; i < d->count; ++i) {
+        const struct ls_entry *e = &d->ents[i];
+        int have_st = e->st.st_mode != 0;
+        int is_dir = have_st ? S_ISDIR(e->st.st_mode) : e->d_type == DT_DIR;
+        /* pruned here, so an ignored subtree is never opened */
+        if (ignoring && node_ignores(ctx, node, d->path, e->name, is_dir)) {
+            BATCH(d)->pruned = 1;
+            continue;
+        }
+        /* an entry filtered out is still walked; its name stays in the arena */
+        const char *name = e->name;
+        if (ctx->opt.count) {
+            d->counts[(have_st ? IFTODT(e->st.st_mode) : e->d_type) & 15]++;
+        } else if (!filter || filter_dirent(filter, e->name, e->d_type)) {
+            if (e->name_len > max_len) max_len = e->name_len;
+            d->ents[kept++] = *e;
+        }
+        if (!descend || !is_dir) continue;
+        /* a mount point is listed but not entered */
+        if (ctx->opt.one_fs && (!have_st || e->st.st_dev != node->dev)) continue;
+        add_subdir(subdirs, nsub, &subcap, name);
+    }
+    d->count = kept;
+    d->max_len = max_len;
+    if (ctx->opt.count) count_finish(d, node, &job);
+    /* keep a descriptor while children still have to be opened under it */
+    if (*nsub > 0 && BATCH(d)->dfd >= 0) fdc_insert(w, node, dup(BATCH(d)->dfd));
+    return 0;
+
+timed_out:
+    d->err = ETIMEDOUT;
+    w->stats.timeouts++;
+    return 0;
+}
+
+static int stat_dir_batch(const struct ls_ctx *ctx, struct helper **hp, struct ls_dir *d);
+
+
+/*
+ * Iterative depth-first walk of one root, pushing every directory onto outq
+ * in the order it is handed out. The explicit node stack lives on the heap,
+ * so depth is bounded by memory rather than the C stack. With stat_inline
+ * the metadata stage runs in the same thread (used by the root worker pool).
+ */
+static void walk_root(struct walker *w, const char *root, int root_idx,
+                      struct queue *outq, int stat_inline) {
+    const struct ls_options *opt = &w->ctx->opt;
+    if (opt->resume_after && root_idx < opt->resume_root) return;
+    struct dir_node *rn = node_new(NULL, root);
+    if (!rn || stack_push(&w->stack, rn) != 0) { free(rn); return; }
+    /* ls_iter_open checked that it starts with root */
+    if (opt->resume_after && root_idx == opt->resume_root) rn->resume = opt->resume_after + strlen(root);
+
+    while (w->stack.count > 0) {
+        struct dir_node *node = w->stack.nodes[--w->stack.count];
+        if (atomic_load(&w->ctx->stop)) { node_unref(node); continue; }
+        struct ls_dir *d = dir_new(node_path(node), node->parent == NULL);
+        if (!d || !d->path) { ls_dir_free(d); node_unref(node); continue; }
+        d->root_idx = root_idx;
+        d->depth = node->depth;
+
+        size_t nsub = 0;
+        if (read_dir_batch(w, d, node, &w->subdirs, &nsub) != 0) {
+            ls_dir_free(d);
+            node_unref(node);
+            continue;
+        }
+
+        /* resuming above the resume point: only subdirectories from its branch on */
+        char *next = NULL;
+        const char *rest = NULL;
+        if (node->resume && *node->resume) {
+            const char *c = node->resume + strspn(node->resume, "/");
+            size_t cl = strcspn(c, "/");
+            next = strndup(c, cl);
+            rest = c + cl;
+        }
+
+        /* push children in reverse so the smallest name is read next */
+        if (nsub > 1) qsort(w->subdirs, nsub, sizeof(char *), opt->collate ? compare_names_coll : compare_names);
+        for (size_t i = nsub; i-- > 0;) {
+            int cmp = next ? ls_compare_names(w->subdirs[i], next, opt->collate) : 1;
+            if (cmp < 0) break;
+            struct dir_node *child = node_new(node, w->subdirs[i]);
+            if (child && cmp == 0) child->resume = rest;
+            if (child && stack_push(&w->stack, child) != 0) node_unref(child);
+        }
+        free(next);
+        int skip = node->resume != NULL;
+        node_unref(node);
+        if (skip) {
+            ls_dir_free(d);
+            continue;
+        }
+        if (stat_inline) {
+            if (d->err == 0 && !BATCH(d)->cached && stat_dir_batch(w->ctx, &w->helper, d) != 0) w->stats.timeouts++;
+            top_offer(w->ctx, &w->top, d);
+        }
+        queue_push(outq, d);
+    }
+}
+
+struct reader_args {
+    struct ls_ctx *ctx;
+    char **roots;
+    int nroots;
+    struct queue *outq;
+};
+
+static void *reader_main(void *arg) {
+    struct reader_args *ra = arg;
+    struct walker w = WALKER_INIT(ra->ctx);
+    for (int r = 0; r < ra->nroots; ++r)
+        walk_root(&w, ra->roots[r], r, ra->outq, 0);
+    walker_free(&w);
+    queue_close(ra->outq);
+    return NULL;
+}
+
+/* ---------- stage 2: metadata ---------- */
+
+/*
+ * Parallel merge sort for huge entry tables: each thread qsorts one
+ * contiguous run, then neighbouring runs are merged pairwise, one thread
+ * per pair, until a single run remains. Small tables just use qsort.
+ */
+struct sort_task {
+    struct ls_entry *src, *dst;
+    int merge;                  /* 0: qsort src[lo, hi); 1: merge the two runs into dst */
+    size_t lo, mid, hi;
+};
+
+static void *sort_task_main(void *arg) {
+    struct sort_task *t = arg;
+    if (!t->merge) {
+        qsort(t->src + t->lo, t->hi - t->lo, sizeof(struct ls_entry), compare_entries);
+        return NULL;
+    }
+    size_t i = t->lo, j = t->mid, k = t->lo;
+    while (i < t->mid && j < t->hi) {
+        if (compare_entries(&t->src[j], &t->src[i]) < 0) t->dst[k++] = t->src[j++];
+        else t->dst[k++] = t->src[i++];
+    }
+    memcpy(&t->dst[k], &t->src[i], (t->mid - i) * sizeof(struct ls_entry));
+    k += t->mid - i;
+    memcpy(&t->dst[k], &t->src[j], (t->hi - j) * sizeof(struct ls_entry));
+    return NULL;
+}
+
+void ls_run_tasks(void *(*fn)(void *), void *tasks, size_t size, int n) {
+    pthread_t tids[LS_MAX_THREADS];
+    int started[LS_MAX_THREADS];
+    for (int i = 0; i < n; ++i)
+        started[i] = pthread_create(&tids[i], NULL, fn, (char *)tasks + (size_t)i * size) == 0;
+    for (int i = 0; i < n; ++i) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else fn((char *)tasks + (size_t)i * size);
+    }
+}
+
+static void sort_entries(struct ls_entry *ents, size_t count, int nthreads) {
+    if (count < 2) return;
+    if (count < PAR_SORT_MIN || nthreads < 2) {
+        qsort(ents, count, sizeof(struct ls_entry), compare_entries);
+        return;
+    }
+    struct ls_entry *tmp = malloc(count * sizeof(struct ls_entry));
+    if (!tmp) {
+        qsort(ents, count, sizeof(struct ls_entry), compare_entries);
+        return;
+    }
+
+    size_t bounds[LS_MAX_THREADS + 1];
+    for (int i = 0; i <= nthreads; ++i) bounds[i] = count * (size_t)i / (size_t)nthreads;
+
+    struct sort_task tasks[LS_MAX_THREADS];
+    for (int i = 0; i < nthreads; ++i)
+        tasks[i] = (struct sort_task){ ents, NULL, 0, bounds[i], bounds[i + 1], bounds[i + 1] };
+    ls_run_tasks(sort_task_main, tasks, sizeof(tasks[0]), nthreads);
+
+    /* merge rounds ping-pong between ents and tmp */
+    struct ls_entry *src = ents, *dst = tmp;
+    int runs = nthreads;
+    while (runs > 1) {
+        int ntasks = 0;
+        for (int r = 0; r < runs; r += 2) {
+            if (r + 1 == runs) {
+                /* odd run out: carried over unchanged */
+                memcpy(&dst[bounds[r]], &src[bounds[r]],
+                       (bounds[r + 1] - bounds[r]) * sizeof(struct ls_entry));
+                continue;
+            }
+            tasks[ntasks++] = (struct sort_task){ src, dst, 1, bounds[r], bounds[r + 1], bounds[r + 2] };
+        }
+        ls_run_tasks(sort_task_main, tasks, sizeof(tasks[0]), ntasks);
+
+        int nruns = 0;
+        for (int r = 0; r < runs; r += 2) bounds[nruns++] = bounds[r];
+        bounds[nruns] = bounds[runs];
+        runs = nruns;
+        struct ls_entry *swap = src; src = dst; dst = swap;
+    }
+    if (src != ents) memcpy(ents, src, count * sizeof(struct ls_entry));
+    free(tmp);
+}
+
+/* comparator for qsort over entry pointers, by inode number */
+static int compare_inos(const void *a, const void *b) {
+    ino_t i1 = (*(struct ls_entry *const *)a)->ino;
+    ino_t i2 = (*(struct ls_entry *const *)b)->ino;
+    return (i1 > i2) - (i1 < i2);
+}
+
+/*
+ * strxfrm every name once into the batch's arena, so the sort compares
+ * keys with strcmp instead of calling strcoll O(n log n) times. If memory
+ * runs out the batch keeps no keys and is sorted by bytes.
+ */
+static void collate_keys(struct ls_dir *d) {
+    char buf[1024];
+    for (size_t i = 0; i < d->count; ++i) {
+        struct ls_entry *e = &d->ents[i];
+        size_t n = strxfrm(buf, e->name, sizeof(buf));
+        char *key = ls_arena_alloc(&BATCH(d)->names, n + 1);
+        if (!key) {
+            for (size_t j = 0; j < i; ++j) d->ents[j].sort_key = NULL;
+            return;
+        }
+        if (n < sizeof(buf)) memcpy(key, buf, n + 1);
+        else strxfrm(key, e->name, n + 1);
+        e->sort_key = key;
+    }
+}
+
+/* lstat (stat with follow_links) one entry of a batch */
+static void stat_entry(struct ls_dir *d, struct ls_entry *e, int stat_flags) {
+    int rc, dfd = BATCH(d)->dfd;
+    if (dfd >= 0) {
+        rc = fstatat(dfd, e->name, &e->st, stat_flags);
+        /* a dangling link is listed as the link itself */
+        if (rc == -1 && errno == ENOENT && stat_flags == 0)
+            rc = fstatat(dfd, e->name, &e->st, AT_SYMLINK_NOFOLLOW);
+    } else {
+        char *path = ls_join_path(d->path, e->name);
+        rc = path ? (stat_flags ? lstat(path, &e->st) : stat(path, &e->st)) : -1;
+        if (rc == -1 && path && errno == ENOENT && stat_flags == 0) rc = lstat(path, &e->st);
+        if (!path) errno = ENOMEM;
+        free(path);
+    }
+    if (rc == -1) e->stat_err = errno;
+}
+
+/* lstat'ing a batch, as a job (see deadlines): the entries are the job's */
+struct stat_job {
+    struct ls_dir *d;
+    int stat_flags;
+    enum ls_stat_order order;
+    int64_t start, interval;    /* throttle: lstat i is due at start + i * interval */
+};
+
+static void stat_job_drop(void *arg) {
+    struct stat_job *j = arg;
+    ls_dir_free(j->d);
+    free(j);
+}
+
+static void job_stat(void *arg) {
+    struct stat_job *j = arg;
+    struct ls_dir *d = j->d;
+    /*
+     * Inode tables are laid out by number, so stat'ing in d_ino order reads
+     * them front to back instead of jumping around in name order; the
+     * batch is sorted by name only afterwards.
+     */
+    struct ls_entry **order = NULL;
+    if (j->order == LS_STAT_INO && d->count > 1 && (order = malloc(d->count * sizeof(*order)))) {
+        for (size_t i = 0; i < d->count; ++i) order[i] = &d->ents[i];
+        qsort(order, d->count, sizeof(*order), compare_inos);
+    }
+    for (size_t i = 0; i < d->count; ++i) {
+        if (j->interval) {
+            int64_t due = j->start + (int64_t)i * j->interval;
+            if (due > now_ns()) sleep_until(due);
+        }
+        stat_entry(d, order ? order[i] : &d->ents[i], j->stat_flags);
+    }
+    free(order);
+    if (BATCH(d)->dfd >= 0) { close(BATCH(d)->dfd); BATCH(d)->dfd = -1; }
+}
+
+/* stat, filter and sort a batch; -1 when it missed dir_timeout (ETIMEDOUT, emptied) */
+static int stat_dir_batch(const struct ls_ctx *ctx, struct helper **hp, struct ls_dir *d) {
+    if (ctx->opt.count) return 0;       /* nothing to stat, only tallies */
+    struct timespec deadline;
+    struct stat_job job = { dir_new(NULL, 0), ctx->opt.follow_links ? 0 : AT_SYMLINK_NOFOLLOW,
+                            ctx->opt.stat_order, 0, 0 };
+    int64_t wait = 0;
+    if (ctx->throttle && ctx->throttle->iops.interval) {
+        /* the job paces itself from the reservation, it never sees the throttle */
+        job.interval = ctx->throttle->iops.interval;
+        job.start = throttle_take(ctx->throttle, &ctx->throttle->iops, d->count);
+        wait = job.start - now_ns() + (int64_t)d->count * job.interval;
+        if (wait < 0) wait = 0;
+    }
+    deadline_set(ctx, &deadline, wait);
+    if (!job.d) {
+        /* no husk to hand over: stat in place */
+        job.d = d;
+        job_stat(&job);
+    } else {
+        /* the path is only needed without a dfd, and then a copy is */
+        if (BATCH(d)->dfd < 0 && !(job.d->path = strdup(d->path))) { ls_dir_free(job.d); d->err = errno; return 0; }
+        dir_take(job.d, d);
+        if (run_job(ctx, hp, &deadline, job_stat, stat_job_drop, &job, sizeof(job)) != 0) {
+            d->err = ETIMEDOUT;
+            return -1;
+        }
+        dir_take(d, job.d);
+        ls_dir_free(job.d);
+    }
+    if (ctx->opt.filter && !ctx->opt.cache_dir) filter_batch(ctx->opt.filter, d, 1);
+    /* top_k alone only needs the metadata, not the order */
+    if (!ctx->opt.top_k || ctx->opt.cache_dir || ctx->opt.tree_totals) {
+        if (ctx->opt.collate) collate_keys(d);
+        sort_entries(d->ents, d->count, ctx->opt.threads);
+    }
+    /* a table with ignored entries left out must not be reused without the rules */
+    if (ctx->opt.cache_dir && BATCH(d)->have_dst && !BATCH(d)->pruned) cache_store(ctx, d);
+    if (ctx->opt.filter && ctx->opt.cache_dir) filter_batch(ctx->opt.filter, d, 0);
+    sum_blocks(d);
+    return 0;
+}
+
+/* ---------- top K ---------- */
+
+/* does a rank above b? ties go to the smaller path so threads agree */
+static int top_above(enum ls_top_by by, const struct ls_entry *a, const struct ls_entry *b) {
+    if (by == LS_TOP_MTIME) {
+        if (a->st.st_mtim.tv_sec != b->st.st_mtim.tv_sec)
+            return a->st.st_mtim.tv_sec > b->st.st_mtim.tv_sec;
+        if (a->st.st_mtim.tv_nsec != b->st.st_mtim.tv_nsec)
+            return a->st.st_mtim.tv_nsec > b->st.st_mtim.tv_nsec;
+    } else if (a->st.st_size != b->st.st_size) {
+        return a->st.st_size > b->st.st_size;
+    }
+    return strcmp(a->name, b->name) < 0;
+}
+
+static void top_sift_down(struct top_heap *h, enum ls_top_by by, size_t i) {
+    for (;;) {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < h->count && top_above(by, &h->ents[m], &h->ents[l])) m = l;
+        if (r < h->count && top_above(by, &h->ents[m], &h->ents[r])) m = r;
+        if (m == i) return;
+        struct ls_entry t = h->ents[i]; h->ents[i] = h->ents[m]; h->ents[m] = t;
+        i = m;
+    }
+}
+
+/* would e make it into a full heap? decided on the key alone, before any copy */
+static int top_wants(const struct ls_ctx *ctx, const struct top_heap *h, const struct ls_entry *e) {
+    if (h->count < ctx->opt.top_k) return 1;
+    const struct ls_entry *min = &h->ents[0];
+    if (ctx->opt.top_by == LS_TOP_MTIME)
+        return e->st.st_mtim.tv_sec > min->st.st_mtim.tv_sec ||
+               (e->st.st_mtim.tv_sec == min->st.st_mtim.tv_sec &&
+                e->st.st_mtim.tv_nsec >= min->st.st_mtim.tv_nsec);
+    return e->st.st_size >= min->st.st_size;
+}
+
+/* take ownership of e (its name is a malloc'ed path) */
+static void top_add(const struct ls_ctx *ctx, struct top_heap *h, struct ls_entry *e) {
+    enum ls_top_by by = ctx->opt.top_by;
+    if (!h->ents) h->ents = malloc(ctx->opt.top_k * sizeof(*h->ents));
+    if (!h->ents) { free((char *)e->name); return; }
+    if (h->count < ctx->opt.top_k) {
+        size_t i = h->count++;
+        h->ents[i] = *e;
+        while (i > 0 && top_above(by, &h->ents[(i - 1) / 2], &h->ents[i])) {
+            struct ls_entry t = h->ents[i]; h->ents[i] = h->ents[(i - 1) / 2]; h->ents[(i - 1) / 2] = t;
+            i = (i - 1) / 2;
+        }
+    } else if (top_above(by, e, &h->ents[0])) {
+        free((char *)h->ents[0].name);
+        h->ents[0] = *e;
+        top_sift_down(h, by, 0);
+    } else {
+        free((char *)e->name);
+    }
+}
+
+/* offer a stat'ed batch's regular files to this thread's heap */
+static void top_offer(const struct ls_ctx *ctx, struct top_heap *h, const struct ls_dir *d) {
+    if (!ctx->opt.top_k || d->err) return;
+    for (size_t i = 0; i < d->count; ++i) {
+        const struct ls_entry *e = &d->ents[i];
+        if (e->stat_err || !S_ISREG(e->st.st_mode) || !top_wants(ctx, h, e)) continue;
+        struct ls_entry c = *e;
+        char *path = ls_join_path(d->path, e->name);
+        if (!path) continue;
+        c.name = path;
+        c.name_len = strlen(path);
+        top_add(ctx, h, &c);
+    }
+}
+
+/* fold a finished thread's heap into the listing's */
+static void top_merge(struct ls_ctx *ctx, struct top_heap *h) {
+    if (!ctx->opt.top_k) return;
+    pthread_mutex_lock(&ctx->totals_mu);
+    for (size_t i = 0; i < h->count; ++i) top_add(ctx, &ctx->top, &h->ents[i]);
+    pthread_mutex_unlock(&ctx->totals_mu);
+    free(h->ents);
+    h->ents = NULL;
+    h->count = 0;
+}
+
+struct meta_args {
+    struct ls_ctx *ctx;
+    struct queue *inq, *outq;
+};
+
+static void *meta_main(void *arg) {
+    struct meta_args *ma = arg;
+    struct top_heap top = { 0 };
+    struct helper *helper = NULL;
+    unsigned long timeouts = 0;
+    struct ls_dir *d;
+    while ((d = queue_pop(ma->inq)) != NULL) {
+        if (d->err == 0 && !BATCH(d)->cached && stat_dir_batch(ma->ctx, &helper, d) != 0) timeouts++;
+        top_offer(ma->ctx, &top, d);
+        queue_push(ma->outq, d);
+    }
+    helper_free(helper);
+    top_merge(ma->ctx, &top);
+    pthread_mutex_lock(&ma->ctx->totals_mu);
+    ma->ctx->totals.timeouts += timeouts;
+    pthread_mutex_unlock(&ma->ctx->totals_mu);
+    queue_close(ma->outq);
+    return NULL;
+}
+
+/* ---------- context ---------- */
+
+/* split the descriptor limit between the walkers that may run at once */
+static int default_fd_budget(int nwalkers) {
+    struct rlimit rl;
+    long limit = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        limit = (long)rl.rlim_cur;
+    /* stdio, batches parked in the queues (each holds a dfd), dups in flight */
+    long reserved = 16 + (long)nwalkers * (2 * PIPE_DEPTH + 4);
+    long per = (limit - reserved) / 2 / nwalkers;
+    return per < 4 ? 4 : per > 4096 ? 4096 : (int)per;
+}
+
+static void ctx_init(struct ls_ctx *ctx, const struct ls_options *opt, int nwalkers) {
+    memset(ctx, 0, sizeof(*ctx));
+    if (opt) ctx->opt = *opt;
+    if (ctx->opt.threads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        ctx->opt.threads = ncpu < 1 ? 1 : (int)ncpu;
+    }
+    if (ctx->opt.threads > LS_MAX_THREADS) ctx->opt.threads = LS_MAX_THREADS;
+    if (ctx->opt.fd_budget <= 0) ctx->opt.fd_budget = default_fd_budget(nwalkers);
+    ctx->start_time = time(NULL);
+    ctx->hide = ignore_compile(ctx->opt.hide, ctx->opt.nhide);
+    if (ctx->opt.follow_links) ctx->visited = visited_new();
+    ctx->throttle = throttle_new(ctx->opt.max_iops, ctx->opt.max_dirs_per_sec);
+    if (ctx->opt.collate) {
+        const char *loc = setlocale(LC_COLLATE, NULL);
+        uint32_t h = 2166136261u;
+        for (; loc && *loc; ++loc) h = (h ^ (unsigned char)*loc) * 16777619u;
+        ctx->coll_tag = h;
+    }
+    atomic_init(&ctx->stop, 0);
+    ctx->totals.fd_budget = ctx->opt.fd_budget;
+    pthread_mutex_init(&ctx->totals_mu, NULL);
+}
+
+static void ctx_free(struct ls_ctx *ctx) {
+    ignore_free(ctx->hide);
+    visited_free(ctx->visited);
+    throttle_free(ctx->throttle);
+    pthread_mutex_destroy(&ctx->totals_mu);
+}
+
+/* ---------- tree totals ---------- */
+
+/* directories waiting for their subtree (a stack) or to be handed out (a FIFO) */
+struct dir_list {
+    struct ls_dir **dirs;
+    size_t head, count, cap;
+};
+
+static int dir_list_push(struct dir_list *l, struct ls_dir *d) {
+    if (l->head + l->count == l->cap) {
+        if (l->head > 0) {
+            memmove(l->dirs, l->dirs + l->head, l->count * sizeof(*l->dirs));
+            l->head = 0;
+        } else {
+            size_t cap = l->cap ? l->cap * 2 : 64;
+            struct ls_dir **tmp = realloc(l->dirs, cap * sizeof(*tmp));
+            if (!tmp) return -1;
+            l->dirs = tmp;
+            l->cap = cap;
+        }
+    }
+    l->dirs[l->head + l->count++] = d;
+    return 0;
+}
+
+/* ---------- iterator ---------- */
+
+/*
+ * Several roots: a bounded pool of workers claims roots in argument order
+ * and walks each into its own queue, while the consumer drains the queues
+ * in argument order. A root is always claimed before any later one, so the
+ * root being consumed is always making progress and the total time
+ * approaches that of the slowest root.
+ */
+struct root_job {
+    char *path;
+    struct queue q;
+};
+
+struct ls_iter {
+    struct ls_ctx ctx;
+    char **roots;
+    int nroots;
+    struct ls_dir *cur;         /* batch last handed out */
+    int done;                   /* every queue drained and every thread joined */
+
+    /* tree_totals: open ancestors, finished directories, counted links */
+    int list_all;               /* hand out every directory, not only roots */
+    struct dir_list open, ready;
+    struct inode_set links;
+    int top_sorted;             /* ctx.top is a sorted array, no longer a heap */
+
+    /* one root: reader and metadata threads */
+    struct queue q_read, q_meta;
+    struct reader_args ra;
+    struct meta_args ma;
+    pthread_t reader, meta;
+
+    /* several roots: worker pool */
+    struct root_job *jobs;
+    int next_job;               /* next unclaimed root, guarded by mu */
+    int drain_job;              /* root being handed out */
+    pthread_mutex_t mu;
+    pthread_t workers[ROOT_WORKERS];
+    int nworkers;
+};
+
+static void *root_worker_main(void *arg) {
+    struct ls_iter *it = arg;
+    struct walker w = WALKER_INIT(&it->ctx);
+    for (;;) {
+        pthread_mutex_lock(&it->mu);
+        int i = it->next_job < it->nroots ? it->next_job++ : -1;
+        pthread_mutex_unlock(&it->mu);
+        if (i < 0) break;
+        walk_root(&w, it->jobs[i].path, i, &it->jobs[i].q, 1);
+        queue_close(&it->jobs[i].q);
+    }
+    walker_free(&w);
+    return NULL;
+}
+
+static int start_pipeline(struct ls_iter *it) {
+    if (queue_init(&it->q_read, PIPE_DEPTH) != 0) return -1;
+    if (queue_init(&it->q_meta, PIPE_DEPTH) != 0) { queue_destroy(&it->q_read); return -1; }
+    it->ra = (struct reader_args){ &it->ctx, it->roots, it->nroots, &it->q_read };
+    it->ma = (struct meta_args){ &it->ctx, &it->q_read, &it->q_meta };
+    int rc = pthread_create(&it->reader, NULL, reader_main, &it->ra);
+    if (rc != 0) goto fail;
+    rc = pthread_create(&it->meta, NULL, meta_main, &it->ma);
+    if (rc != 0) {
+        /* nobody will consume q_read: stop the reader and empty it here */
+        atomic_store(&it->ctx.stop, 1);
+        struct ls_dir *d;
+        while ((d = queue_pop(&it->q_read)) != NULL) ls_dir_free(d);
+        pthread_join(it->reader, NULL);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    queue_destroy(&it->q_read);
+    queue_destroy(&it->q_meta);
+    errno = rc;
+    return -1;
+}
+
+static int start_pool(struct ls_iter *it) {
+    it->jobs = calloc((size_t)it->nroots, sizeof(struct root_job));
+    if (!it->jobs) return -1;
+    pthread_mutex_init(&it->mu, NULL);
+    for (int i = 0; i < it->nroots; ++i) {
+        it->jobs[i].path = it->roots[i];
+        if (queue_init(&it->jobs[i].q, PIPE_DEPTH) != 0) {
+            while (i-- > 0) queue_destroy(&it->jobs[i].q);
+            free(it->jobs);
+            return -1;
+        }
+    }
+    int want = it->nroots < ROOT_WORKERS ? it->nroots : ROOT_WORKERS;
+    for (; it->nworkers < want; ++it->nworkers) {
+        int rc = pthread_create(&it->workers[it->nworkers], NULL, root_worker_main, it);
+        if (rc != 0) {
+            if (it->nworkers > 0) break;      /* fewer workers still finish the job */
+            for (int i = 0; i < it->nroots; ++i) queue_destroy(&it->jobs[i].q);
+            free(it->jobs);
+            errno = rc;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct ls_iter *ls_iter_open(char **roots, int nroots, const struct ls_options *opt) {
+    if (nroots < 1) { errno = EINVAL; return NULL; }
+    if (opt && opt->count && (opt->filter || opt->tree_totals || opt->top_k)) { errno = EINVAL; return NULL; }
+    if (opt && opt->resume_after) {
+        /* the resume point must be a path under its root */
+        const char *r = opt->resume_root >= 0 && opt->resume_root < nroots ? roots[opt->resume_root] : NULL;
+        size_t rl = r ? strlen(r) : 0;
+        if (!r || opt->tree_totals || strncmp(opt->resume_after, r, rl) != 0 ||
+            (opt->resume_after[rl] != '\0' && opt->resume_after[rl] != '/')) {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    struct ls_iter *it = calloc(1, sizeof(*it));
+    if (!it) return NULL;
+    it->roots = roots;
+    it->nroots = nroots;
+    int nwalkers = nroots > 1 ? (nroots < ROOT_WORKERS ? nroots : ROOT_WORKERS) : 1;
+    ctx_init(&it->ctx, opt, nwalkers);
+    /* totals need the whole tree even when only the roots are listed */
+    it->list_all = it->ctx.opt.recursive;
+    if (it->ctx.opt.tree_totals) it->ctx.opt.recursive = 1;
+    if ((nroots > 1 ? start_pool(it) : start_pipeline(it)) != 0) {
+        int err = errno;
+        ctx_free(&it->ctx);
+        free(it);
+        errno = err;
+        return NULL;
+    }
+    return it;
+}
+
+static struct ls_dir *iter_pop(struct ls_iter *it) {
+    if (!it->jobs) return queue_pop(&it->q_meta);
+    while (it->drain_job < it->nroots) {
+        struct ls_dir *d = queue_pop(&it->jobs[it->drain_job].q);
+        if (d) return d;
+        it->drain_job++;
+    }
+    return NULL;
+}
+
+/* all queues are closed once drained, so the threads are finishing */
+static void iter_join(struct ls_iter *it) {
+    if (it->jobs) {
+        for (int i = 0; i < it->nworkers; ++i) pthread_join(it->workers[i], NULL);
+    } else {
+        pthread_join(it->reader, NULL);
+        pthread_join(it->meta, NULL);
+    }
+    it->done = 1;
+}
+
+/* new directory below the open ones: count its entries once */
+static void totals_open(struct ls_iter *it, struct ls_dir *d) {
+    d->tree_blocks = 0;
+    for (size_t i = 0; i < d->count; ++i) {
+        struct ls_entry *e = &d->ents[i];
+        e->tree_blocks = 0;
+        if (e->stat_err) continue;
+        if (!S_ISDIR(e->st.st_mode) && e->st.st_nlink > 1 &&
+            !inode_set_add(&it->links, e->st.st_dev, e->st.st_ino))
+            continue;
+        e->tree_blocks = e->st.st_blocks;
+    }
+}
+
+/* the innermost open directory has its whole subtree: add it to its parent */
+static void totals_close(struct ls_iter *it) {
+    struct dir_list *o = &it->open;
+    struct ls_dir *d = o->dirs[--o->count];
+    for (size_t i = 0; i < d->count; ++i) d->tree_blocks += d->ents[i].tree_blocks;
+
+    struct ls_dir *p = o->count ? o->dirs[o->count - 1] : NULL;
+    const char *slash = strrchr(d->path, '/');
+    if (p && d->depth > 0 && p->depth == d->depth - 1 && p->root_idx == d->root_idx && slash) {
+        struct ls_entry key = { .name = slash + 1 };
+        /* by name: tables from the cache carry no sort keys */
+        struct ls_entry *e = bsearch(&key, p->ents, p->count, sizeof(*e),
+                                     it->ctx.opt.collate ? compare_entries_coll : compare_entries);
+        if (e) e->tree_blocks += d->tree_blocks;
+    }
+    if ((d->depth == 0 || it->list_all) && dir_list_push(&it->ready, d) == 0) return;
+    ls_dir_free(d);
+}
+
+static struct ls_dir *totals_next(struct ls_iter *it) {
+    for (;;) {
+        if (it->ready.count > 0) {
+            it->ready.count--;
+            return it->ready.dirs[it->ready.head++];
+        }
+        struct ls_dir *d = it->done ? NULL : iter_pop(it);
+        if (!d) {
+            if (it->open.count == 0) return NULL;
+            totals_close(it);
+            continue;
+        }
+        while (it->open.count > 0) {
+            struct ls_dir *top = it->open.dirs[it->open.count - 1];
+            if (top->root_idx == d->root_idx && top->depth < d->depth) break;
+            totals_close(it);
+        }
+        totals_open(it, d);
+        if (dir_list_push(&it->open, d) != 0) ls_dir_free(d);
+    }
+}
+
+static void totals_free(struct ls_iter *it) {
+    for (size_t i = 0; i < it->open.count; ++i) ls_dir_free(it->open.dirs[i]);
+    for (size_t i = 0; i < it->ready.count; ++i) ls_dir_free(it->ready.dirs[it->ready.head + i]);
+    free(it->open.dirs);
+    free(it->ready.dirs);
+    free(it->links.keys);
+}
+
+const struct ls_dir *ls_iter_next(struct ls_iter *it) {
+    ls_dir_free(it->cur);
+    if (it->ctx.opt.tree_totals) {
+        it->cur = totals_next(it);
+        if (!it->cur && !it->done) iter_join(it);
+        return it->cur;
+    }
+    it->cur = it->done ? NULL : iter_pop(it);
+    /* join here so the counters are final as soon as the walk is */
+    if (!it->cur && !it->done) iter_join(it);
+    return it->cur;
+}
+
+void ls_iter_stats(struct ls_iter *it, struct ls_stats *st) {
+    pthread_mutex_lock(&it->ctx.totals_mu);
+    *st = it->ctx.totals;
+    pthread_mutex_unlock(&it->ctx.totals_mu);
+}
+
+const struct ls_entry *ls_iter_top(struct ls_iter *it, size_t *n) {
+    struct top_heap *h = &it->ctx.top;
+    pthread_mutex_lock(&it->ctx.totals_mu);
+    if (!it->top_sorted && it->done) {
+        /* heapsort in place: repeatedly moving the worst to the end leaves best first */
+        size_t count = h->count;
+        while (h->count > 1) {
+            struct ls_entry t = h->ents[0]; h->ents[0] = h->ents[h->count - 1]; h->ents[h->count - 1] = t;
+            h->count--;
+            top_sift_down(h, it->ctx.opt.top_by, 0);
+        }
+        h->count = count;
+        it->top_sorted = 1;
+    }
+    *n = h->count;
+    pthread_mutex_unlock(&it->ctx.totals_mu);
+    return h->ents;
+}
+
+void ls_iter_close(struct ls_iter *it) {
+    if (!it) return;
+    atomic_store(&it->ctx.stop, 1);
+    ls_dir_free(it->cur);
+    it->cur = NULL;
+    if (!it->done) {
+        struct ls_dir *d;
+        while ((d = iter_pop(it)) != NULL) ls_dir_free(d);
+        iter_join(it);
+    }
+    totals_free(it);
+    for (size_t i = 0; i < it->ctx.top.count; ++i) free((char *)it->ctx.top.ents[i].name);
+    free(it->ctx.top.ents);
+
+    if (it->jobs) {
+        for (int i = 0; i < it->nroots; ++i) queue_destroy(&it->jobs[i].q);
+        pthread_mutex_destroy(&it->mu);
+        free(it->jobs);
+    } else {
+        queue_destroy(&it->q_read);
+        queue_destroy(&it->q_meta);
+    }
+    ctx_free(&it->ctx);
+    free(it);
+}
+
+/* ---------- callback and single directory ---------- */
+int ls_walk(char **roots, int nroots, const struct ls_options *opt, ls_dir_fn fn, void *ctx) {
+    struct ls_iter *it = ls_iter_open(roots, nroots, opt);
+    if (!it) return -1;
+    const struct ls_dir *d;
+    int rc = 0;
+    while (rc == 0 && (d = ls_iter_next(it)) != NULL) rc = fn(d, ctx);
+    ls_iter_close(it);
+    return rc;
+}
+
+struct ls_dir *ls_read_dir(const char *path, const struct ls_options *opt) {
+    struct ls_ctx ctx;
+    ctx_init(&ctx, opt, 1);
+    ctx.opt.recursive = 0;
+    struct walker w = WALKER_INIT(&ctx);
+    struct dir_node *node = node_new(NULL, path);
+    struct ls_dir *d = node ? dir_new(node_path(node), 1) : NULL;
+    if (d && !d->path) { ls_dir_free(d); d = NULL; }
+    if (d) {
+        size_t nsub = 0;
+        read_dir_batch(&w, d, node, &w.subdirs, &nsub);
+        if (d->err == 0 && !BATCH(d)->cached) stat_dir_batch(&ctx, &w.helper, d);
+    }
+    node_unref(node);
+    walker_free(&w);
+    ctx_free(&ctx);
+    return d;
+}
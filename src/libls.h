@@ -0,0 +1,284 @@
+/* libls.h
+ * Directory traversal library behind ls(1).
+ *
+ * libls reads, stats and sorts directories and hands them out one batch
+ * (one directory) at a time, in the order ls prints them: roots in
+ * argument order, each walked depth-first with children in name order.
+ * Reading, stat'ing and sorting run on background threads; the caller only
+ * consumes finished batches, either by pulling them from an iterator or
+ * through a callback:
+ *
+ *   struct ls_options opt = { .recursive = 1 };
+ *   struct ls_iter *it = ls_iter_open(roots, nroots, &opt);
+ *   const struct ls_dir *d;
+ *   while ((d = ls_iter_next(it)) != NULL)
+ *       for (size_t i = 0; i < d->count; ++i)
+ *           index_entry(d->path, &d->ents[i]);
+ *   ls_iter_close(it);
+ *
+ * A batch stays valid until the next ls_iter_next() (or until the callback
+ * returns). Entries that must outlive it are copied into an arena the
+ * caller owns with ls_dir_copy_entries().
+ */
+#ifndef LIBLS_H
+#define LIBLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* bump allocator; everything allocated from it is freed at once */
+struct ls_arena_block {
+    struct ls_arena_block *next;
+    size_t used, cap;
+    char data[];
+};
+
+struct ls_arena {
+    struct ls_arena_block *head;        /* zero-initialize before first use */
+};
+
+void *ls_arena_alloc(struct ls_arena *a, size_t n);
+char *ls_arena_strdup(struct ls_arena *a, const char *s, size_t len);
+void ls_arena_free(struct ls_arena *a);
+
+/* one directory entry */
+struct ls_entry {
+    const char *name;
+    size_t name_len;
+    ino_t ino;
+    unsigned char d_type;
+    int stat_err;               /* errno from lstat, 0 when st is valid */
+    struct stat st;
+    blkcnt_t tree_blocks;       /* tree_totals: st_blocks of the entry plus, for a
+                                   directory, everything below it; 0 for a hard
+                                   link already counted elsewhere */
+    const char *sort_key;       /* collate: strxfrm(name) while the batch lives,
+                                   NULL when not computed */
+};
+
+/* one directory: its sorted entry table; only the library allocates these */
+struct ls_dir {
+    char *path;                 /* root as given, then root/child/... */
+    int is_root;                /* a root passed to ls_iter_open */
+    int root_idx;               /* which root this directory is under */
+    int err;                    /* errno from opening the directory, 0 on success */
+    size_t depth;               /* 0 for a root */
+    struct ls_entry *ents;
+    size_t count;
+    size_t max_len;             /* longest name */
+    uint64_t counts[16];        /* count mode: entries by d_type (DT_REG, ...) */
+    int estimated;              /* ... extrapolated from a sample */
+    double weight;              /* ... directories of the tree this one stands for */
+    blkcnt_t blocks;            /* st_blocks of all entries */
+    blkcnt_t tree_blocks;       /* tree_totals: tree_blocks of all entries */
+};
+
+enum ls_top_by { LS_TOP_SIZE, LS_TOP_MTIME };
+
+/*
+ * Count mode: directories are read with raw getdents and handed out with
+ * no entries, only counts[] of the names they hold by d_type (as far as
+ * the filesystem reports it), hidden names left out like in listings.
+ * Nothing is allocated for names that cannot be directories and nothing
+ * is stat'ed. LS_COUNT_ESTIMATE reads only the first sample_buffers
+ * buffers of a directory and extrapolates from its size; directories
+ * found in the sample carry a weight > 1 for the ones that were not, so
+ * the sum of counts * weight over a walk estimates the whole tree. Not
+ * with filter, tree_totals or top_k; cache_dir is not used.
+ */
+enum ls_count_mode { LS_COUNT_OFF, LS_COUNT_EXACT, LS_COUNT_ESTIMATE };
+
+/* order entries are stat'ed in; the batch is sorted by name afterwards either way */
+enum ls_stat_order {
+    LS_STAT_INO,                /* by d_ino, for locality in the inode tables */
+    LS_STAT_READDIR             /* as readdir returned them */
+};
+
+/*
+ * Filters: an entry is listed only if it passes every test. Tests on the
+ * name and d_type run in the reader, before anything is stat'ed; the rest
+ * run on the stat results, before the batch is sorted. Directories that
+ * fail are still descended into. With a cache the stored tables stay
+ * complete and are filtered after loading.
+ */
+enum ls_test { LS_TEST_TYPE, LS_TEST_NAME, LS_TEST_SIZE, LS_TEST_NEWER };
+
+struct ls_pred {
+    enum ls_test test;
+    mode_t type;                /* TYPE: S_IFREG, S_IFDIR, ... */
+    const char *glob;           /* NAME: fnmatch(3) pattern */
+    int cmp;                    /* SIZE: -1 smaller, 0 exactly, 1 larger than size */
+    off_t size;
+    struct timespec time;       /* NEWER: mtime strictly after time */
+};
+
+struct ls_filter {
+    struct ls_pred *preds;      /* in evaluation order, see ls_filter_add */
+    size_t count;
+    size_t ndirent;             /* preds[0..ndirent) need no stat */
+};
+
+/* append a test, keeping the cheap ones first; 0, or -1 with errno set */
+int ls_filter_add(struct ls_filter *f, const struct ls_pred *p);
+void ls_filter_free(struct ls_filter *f);
+/* 1 when a stat'ed entry passes every test; one whose stat failed passes */
+int ls_filter_match(const struct ls_filter *f, const struct ls_entry *e);
+
+struct ls_options {
+    int recursive;              /* descend into subdirectories */
+    size_t max_depth;           /* ... at most this far below a root, 0: no limit */
+    int one_fs;                 /* ... only on the root's filesystem */
+    enum ls_stat_order stat_order;
+    int collate;                /* name order by LC_COLLATE (as set with setlocale)
+                                   instead of bytes */
+    int follow_links;           /* stat and descend through symlinks; every
+                                   directory is walked once, so cycles end */
+    const char *cache_dir;      /* reuse/store sorted tables here, NULL: off */
+    int threads;                /* threads for sorting huge tables, 0: online CPUs */
+    int fd_budget;              /* cached dir fds per walker, 0: from RLIMIT_NOFILE */
+    int tree_totals;            /* roll sizes up the tree (see below) */
+    size_t top_k;               /* keep the K largest/newest regular files, 0: off */
+    enum ls_top_by top_by;
+    const struct ls_filter *filter; /* NULL: list everything; must outlive the walk */
+    const char *const *hide;    /* ignore patterns, see below */
+    size_t nhide;
+    int gitignore;              /* also obey .gitignore files found on the way */
+    unsigned dir_timeout;       /* ms for reading a directory, and again for
+                                   stat'ing it, 0: wait forever (see below) */
+    unsigned max_iops;          /* opens, directory reads and lstats per second
+                                   over all threads, 0: unlimited */
+    unsigned max_dirs_per_sec;  /* directories read per second, 0: unlimited */
+    enum ls_count_mode count;
+    size_t sample_buffers;      /* estimate: per directory, 0: 4 */
+    const char *resume_after;   /* continue a walk after this directory, a path as
+                                   handed out under root resume_root (see below) */
+    int resume_root;
+};
+
+/*
+ * Resuming: directories are handed out in a fixed order, so where a walk
+ * stopped is described by the last directory handed out. Given that, the
+ * roots before resume_root and every directory up to and including
+ * resume_after are skipped: its ancestors are read again only to find
+ * their later subdirectories. Whatever changed in the tree meanwhile shows
+ * up as if the walk had run straight through. Not with tree_totals (the
+ * order is different); with follow_links, directories reached before the
+ * resume point may be listed again under another name.
+ */
+
+/*
+ * dir_timeout: a directory on a hung mount (a dead NFS server, say) would
+ * otherwise block the whole walk. Its open/readdir (with any reopening of
+ * evicted ancestors and the cache_dir lookup) and its lstat's run on
+ * helper threads; one that misses the deadline is handed out with err
+ * ETIMEDOUT and no entries, is not descended into, and the walk goes on.
+ * The helper stuck in the call is left behind, detached, and exits on its
+ * own if the call ever returns. Time held back by max_iops does not count.
+ */
+
+/*
+ * Ignore patterns: matching entries are neither listed nor descended into,
+ * so an ignored subtree is never opened. A pattern without '/' matches a
+ * name at any depth, one with '/' the path below the directory the rule
+ * comes from (the roots for hide), and a trailing '/' matches directories
+ * only. .gitignore files apply to their directory and everything below;
+ * negated ("!") patterns are not supported and skipped.
+ */
+
+/*
+ * tree_totals: directory sizes are summed bottom-up, du style, with each
+ * hard-linked inode counted once. A directory's total is only known after
+ * its whole subtree has been read, so directories are handed out in
+ * post-order (each after everything below it) and only the chain of open
+ * ancestors is held back. Without recursive the walk still descends but
+ * only the roots are handed out.
+ */
+
+struct ls_stats {
+    int fd_budget;              /* per walker */
+    unsigned long opens;        /* directories opened */
+    unsigned long relative;     /* ... of which with openat on a cached parent */
+    unsigned long evictions;    /* cached fds closed to stay within budget */
+    unsigned long reopens;      /* evicted ancestors that had to be opened again */
+    unsigned long cache_hits;   /* tables reused from the cache */
+    unsigned long cache_misses;
+    unsigned long timeouts;     /* directories that missed dir_timeout, each leaving
+                                   one helper thread stuck */
+};
+
+/* ---------- iterator ---------- */
+struct ls_iter;
+
+/* NULL with errno set on failure; roots must outlive the iterator */
+struct ls_iter *ls_iter_open(char **roots, int nroots, const struct ls_options *opt);
+/* next finished batch, NULL at the end */
+const struct ls_dir *ls_iter_next(struct ls_iter *it);
+/* counters so far; complete once ls_iter_next has returned NULL */
+void ls_iter_stats(struct ls_iter *it, struct ls_stats *st);
+/*
+ * top_k winners, best first, with name set to the full path; valid until
+ * ls_iter_close and complete once ls_iter_next has returned NULL. Each
+ * thread keeps its own K-entry min-heap, merged when the thread finishes,
+ * so memory stays O(K) per thread. Batches are not sorted in this mode
+ * unless the cache or tree_totals need them to be.
+ */
+const struct ls_entry *ls_iter_top(struct ls_iter *it, size_t *n);
+/* may be called before the end: the walk is stopped and drained */
+void ls_iter_close(struct ls_iter *it);
+
+/*
+ * The order names are listed and walked in: strcoll with collate, ties
+ * and otherwise strcmp. Batches are sorted on strxfrm keys computed once
+ * per entry, which orders the same way.
+ */
+int ls_compare_names(const char *a, const char *b, int collate);
+
+/* ---------- callback ---------- */
+/* return non-zero from fn to stop early */
+typedef int (*ls_dir_fn)(const struct ls_dir *d, void *ctx);
+
+/* 0 when the walk ran to the end, fn's value if it stopped, -1 on error */
+int ls_walk(char **roots, int nroots, const struct ls_options *opt, ls_dir_fn fn, void *ctx);
+
+/* ---------- single directory ---------- */
+/* read, stat and sort one directory synchronously; check d->err */
+struct ls_dir *ls_read_dir(const char *path, const struct ls_options *opt);
+void ls_dir_free(struct ls_dir *d);
+
+/* copy d's entries and names into a; NULL when out of memory */
+struct ls_entry *ls_dir_copy_entries(const struct ls_dir *d, struct ls_arena *a);
+
+/* ---------- helpers, shared with ls ---------- */
+#define LS_MAX_THREADS  8       /* cap for sort and format threads */
+
+/* "dir/name" in a fresh heap buffer, NULL when out of memory */
+char *ls_join_path(const char *dir, const char *name);
+/*
+ * run n <= LS_MAX_THREADS tasks of size bytes each, one per thread,
+ * falling back to the caller's thread where spawning fails
+ */
+void ls_run_tasks(void *(*fn)(void *), void *tasks, size_t size, int n);
+
+/* ---------- entry records ---------- */
+/*
+ * Fixed-size on-disk form of an entry, used by the cache and by snapshot
+ * files; names live in a separate blob of NUL-terminated strings.
+ */
+struct ls_rec {
+    uint64_t dev, ino, rdev, size, blocks;
+    int64_t atime_sec, atime_nsec, mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    uint32_t mode, nlink, uid, gid, blksize;
+    uint32_t name_off, name_len;
+    int32_t stat_err;
+    uint8_t d_type, pad[7];
+};
+
+void ls_rec_from_entry(struct ls_rec *r, const struct ls_entry *e, uint32_t name_off);
+void ls_entry_from_rec(struct ls_entry *e, const struct ls_rec *r, const char *names);
+/* r must point at a NUL-terminated name inside the blob */
+int ls_rec_name_ok(const struct ls_rec *r, const char *names, uint64_t names_size);
+
+#endif /* LIBLS_H */
@@ -2,7 +2,12 @@
  * Version 1.6.0 — Recursive Listing (-R)
  *
  * Builds on v1.5.0: color, sorting, column/ horizontal / long formats.
- * Adds recursive descent with -R (does not follow symlinks).
+ * Adds recursive descent with -R (follows symlinks only with -L).
+ *
+ * Reading, stat'ing, sorting and walking live in libls (libls.c), which
+ * hands out one sorted directory at a time in print order while the next
+ * ones are still being read. This file is the command-line front end:
+ * options, rendering, snapshots, the listing daemon and watch mode.
  */
 
 #include <stdio.h>
@@ -11,6 +16,8 @@
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <pwd.h>
@@ -18,7 +25,24 @@
 #include <time.h>
 #include <stdbool.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <limits.h>
+#include <locale.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+#include "libls.h"
+#include "lsbin.h"
 
 #define ANSI_RESET      "\033[0m"
 #define ANSI_BLUE       "\033[0;34m"
@@ -27,19 +51,56 @@
 #define ANSI_MAGENTA    "\033[0;35m"
 #define ANSI_REVERSE    "\033[7m"
 
-void do_ls(const char *dir);
-void do_ls_long(const char *dir);
-void do_ls_horizontal(const char *dir);
-void print_file_details(const char *path, const char *filename);
-void print_permissions(mode_t mode);
+#define OUTBUF_SIZE     (64 * 1024)
+#define PAR_RENDER_MIN  (1 << 14) /* entries before -l formatting goes parallel */
+
+/* ---------- data types ---------- */
+
+/* buffered output, flushed with write(2); fd < 0 keeps everything in memory */
+struct outbuf {
+    int fd;
+    char *buf;
+    size_t len, cap;
+    uint64_t written;           /* bytes that went to fd */
+};
+
+enum DisplayMode { DEFAULT, LONG_LIST, HORIZONTAL };
+
+void print_file_details(struct outbuf *ob, const struct ls_entry *e);
+void print_permissions(struct outbuf *ob, mode_t mode);
 int get_terminal_width(void);
-int compare_names(const void *a, const void *b);
 static bool is_archive_name(const char *name);
-static void print_colored_name_no_pad(const char *dir, const char *name);
-static void print_colored_name_padded(const char *dir, const char *name, int col_width);
+static void print_colored_name_no_pad(struct outbuf *ob, const struct ls_entry *e);
+static void print_colored_name_padded(struct outbuf *ob, const struct ls_entry *e, int col_width);
 
 /* global recursion flag (set by main when -R present) */
 static int recursive_flag = 0;
+static enum DisplayMode display_mode = DEFAULT;
+static int term_width = 80;
+static struct outbuf out;
+static int par_threads = 1;     /* online CPUs, capped at LS_MAX_THREADS */
+static const char *cache_dir = NULL;
+static struct ls_stats walk_totals;
+static int size_flag = 0;       /* -s: allocated size in 1K blocks */
+static int inode_flag = 0;      /* -i */
+static int human_flag = 0;      /* -h: sizes as 1.5K, 23M, ... */
+static int tree_totals = 0;     /* --total: directories count everything below them */
+static size_t top_k = 0;        /* --top=K */
+static enum ls_top_by top_by = LS_TOP_SIZE;
+static struct ls_filter filter; /* --name, --type, --size, --newer */
+static const char **hide_pats;  /* -I/--hide */
+static size_t nhide;
+static int gitignore_flag = 0;  /* --gitignore */
+static size_t max_depth = 0;    /* --max-depth, 0: unlimited */
+static int one_fs_flag = 0;     /* --one-file-system */
+static int follow_flag = 0;     /* -L */
+static enum ls_stat_order stat_order = LS_STAT_INO; /* --stat-order */
+static unsigned dir_timeout = 0; /* --dir-timeout, in ms */
+static unsigned max_iops = 0, max_dirs_per_sec = 0;
+static enum ls_count_mode count_mode = LS_COUNT_OFF; /* --count, --estimate */
+static int count_types = 0;     /* --count=types */
+static size_t sample_buffers = 0; /* --estimate=N */
+static int collate_flag = 0;    /* LC_COLLATE is not plain byte order */
 
 /* helper: terminal width */
 int get_terminal_width(void) {
@@ -49,13 +110,6 @@ int get_terminal_width(void) {
     return (int)w.ws_col;
 }
 
-/* comparator for qsort */
-int compare_names(const void *a, const void *b) {
-    const char *n1 = *(const char **)a;
-    const char *n2 = *(const char **)b;
-    return strcmp(n1, n2);
-}
-
 /* check archive extensions at end of name */
 static bool is_archive_name(const char *name) {
     if (!name) return false;
@@ -68,299 +122,2475 @@ static bool is_archive_name(const char *name) {
     return false;
 }
 
-/* print colored name without padding (used by padded printer) */
-static void print_colored_name_no_pad(const char *dir, const char *name) {
-    char path[PATH_MAX];
-    struct stat st;
-    if (snprintf(path, sizeof(path), "%s/%s", dir, name) < 0) {
-        printf("%s", name);
+/* ---------- output buffer ---------- */
+static void ob_init(struct outbuf *ob, int fd) {
+    ob->fd = fd;
+    ob->len = 0;
+    ob->written = 0;
+    ob->cap = OUTBUF_SIZE;
+    ob->buf = malloc(ob->cap);
+    if (!ob->buf) { perror("malloc"); exit(EXIT_FAILURE); }
+}
+
+static void ob_free(struct outbuf *ob) {
+    free(ob->buf);
+    ob->buf = NULL;
+    ob->len = ob->cap = 0;
+}
+
+/* memory-only buffers grow instead of flushing */
+static int ob_grow(struct outbuf *ob, size_t need) {
+    size_t cap = ob->cap ? ob->cap : OUTBUF_SIZE;
+    while (cap - ob->len < need) cap *= 2;
+    char *tmp = realloc(ob->buf, cap);
+    if (!tmp) return -1;
+    ob->buf = tmp;
+    ob->cap = cap;
+    return 0;
+}
+
+static void ob_flush(struct outbuf *ob) {
+    if (ob->fd < 0) return;
+    size_t off = 0;
+    while (off < ob->len) {
+        ssize_t n = write(ob->fd, ob->buf + off, ob->len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;              /* EPIPE and friends: drop the rest */
+        }
+        off += (size_t)n;
+    }
+    ob->written += off;
+    ob->len = 0;
+}
+
+static void ob_write(struct outbuf *ob, const char *s, size_t n) {
+    if (ob->len + n > ob->cap && ob->fd < 0) {
+        if (ob_grow(ob, n) != 0) return;
+    } else if (ob->len + n > ob->cap) {
+        ob_flush(ob);
+        if (n > ob->cap) {
+            size_t off = 0;
+            while (off < n) {
+                ssize_t w = write(ob->fd, s + off, n - off);
+                if (w < 0) { if (errno == EINTR) continue; break; }
+                off += (size_t)w;
+            }
+            ob->written += off;
+            return;
+        }
+    }
+    memcpy(ob->buf + ob->len, s, n);
+    ob->len += n;
+}
+
+static void ob_puts(struct outbuf *ob, const char *s) {
+    ob_write(ob, s, strlen(s));
+}
+
+static void ob_putc(struct outbuf *ob, char c) {
+    if (ob->len == ob->cap) {
+        if (ob->fd >= 0) ob_flush(ob);
+        else if (ob_grow(ob, 1) != 0) return;
+    }
+    ob->buf[ob->len++] = c;
+}
+
+static void ob_pad(struct outbuf *ob, int n) {
+    while (n-- > 0) ob_putc(ob, ' ');
+}
+
+/* decimal digits without printf */
+static void ob_u64(struct outbuf *ob, uint64_t v) {
+    char tmp[20];
+    int n = 0;
+    do { tmp[sizeof(tmp) - 1 - n++] = (char)('0' + v % 10); v /= 10; } while (v);
+    ob_write(ob, tmp + sizeof(tmp) - n, (size_t)n);
+}
+
+static void ob_i64(struct outbuf *ob, int64_t v) {
+    if (v < 0) { ob_putc(ob, '-'); ob_u64(ob, (uint64_t)0 - (uint64_t)v); }
+    else ob_u64(ob, (uint64_t)v);
+}
+
+static void ob_printf(struct outbuf *ob, const char *fmt, ...) {
+    char tmp[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(tmp)) { ob_write(ob, tmp, (size_t)n); return; }
+
+    char *big = malloc((size_t)n + 1);
+    if (!big) return;
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    ob_write(ob, big, (size_t)n);
+    free(big);
+}
+
+/* errors go to stderr; flush stdout first so they land near their listing */
+static struct outbuf *err_sink;   /* --serve: errors travel back to the client */
+
+static void report_error(const char *what, int err) {
+    if (err_sink) {
+        ob_puts(err_sink, what);
+        ob_puts(err_sink, ": ");
+        ob_puts(err_sink, strerror(err));
+        ob_putc(err_sink, '\n');
         return;
     }
-    if (lstat(path, &st) == -1) {
-        printf("%s", name);
+    ob_flush(&out);
+    errno = err;
+    perror(what);
+}
+
+/* ---------- stage 3: renderer ---------- */
+
+/*
+ * uid/gid -> name, resolved through NSS once per id and shared by all
+ * formatting threads. Names never change for the life of the process.
+ */
+#define ID_CACHE_SIZE   1024
+
+struct id_name {
+    int used;
+    unsigned id;
+    char *name;                 /* NULL: id has no entry */
+};
+
+static struct id_name user_cache[ID_CACHE_SIZE], group_cache[ID_CACHE_SIZE];
+static pthread_mutex_t id_cache_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static char *lookup_id_name(int is_group, unsigned id) {
+    char buf[4096];
+    if (is_group) {
+        struct group grp, *gr = NULL;
+        getgrgid_r((gid_t)id, &grp, buf, sizeof(buf), &gr);
+        return gr ? strdup(gr->gr_name) : NULL;
+    }
+    struct passwd pwd, *pw = NULL;
+    getpwuid_r((uid_t)id, &pwd, buf, sizeof(buf), &pw);
+    return pw ? strdup(pw->pw_name) : NULL;
+}
+
+/* cached name or NULL if the id is unknown */
+static const char *id_name(int is_group, unsigned id) {
+    struct id_name *tab = is_group ? group_cache : user_cache;
+    pthread_mutex_lock(&id_cache_mu);
+    size_t i = (id * 2654435761u) % ID_CACHE_SIZE;
+    for (size_t probes = 0; probes < ID_CACHE_SIZE; ++probes, i = (i + 1) % ID_CACHE_SIZE) {
+        if (tab[i].used && tab[i].id == id) {
+            pthread_mutex_unlock(&id_cache_mu);
+            return tab[i].name;
+        }
+        if (!tab[i].used) {
+            tab[i].used = 1;
+            tab[i].id = id;
+            tab[i].name = lookup_id_name(is_group, id);
+            pthread_mutex_unlock(&id_cache_mu);
+            return tab[i].name;
+        }
+    }
+    pthread_mutex_unlock(&id_cache_mu);
+    return NULL;                /* table full: more distinct ids than anyone has */
+}
+
+static const char *user_name(uid_t uid) { return id_name(0, (unsigned)uid); }
+static const char *group_name(gid_t gid) { return id_name(1, (unsigned)gid); }
+
+/* print colored name without padding (used by padded printer) */
+static void print_colored_name_no_pad(struct outbuf *ob, const struct ls_entry *e) {
+    if (e->stat_err) {
+        ob_write(ob, e->name, e->name_len);
         return;
     }
 
+    mode_t m = e->st.st_mode;
     const char *start = "";
-    const char *end = ANSI_RESET;
 
-    if (S_ISLNK(st.st_mode)) {
+    if (S_ISLNK(m)) {
         start = ANSI_MAGENTA;
-    } else if (S_ISDIR(st.st_mode)) {
+    } else if (S_ISDIR(m)) {
         start = ANSI_BLUE;
-    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+    } else if (S_ISCHR(m) || S_ISBLK(m) || S_ISSOCK(m) || S_ISFIFO(m)) {
         start = ANSI_REVERSE;
-    } else if ((st.st_mode & (S_IXUSR|S_IXGRP|S_IXOTH)) != 0) {
+    } else if ((m & (S_IXUSR|S_IXGRP|S_IXOTH)) != 0) {
         start = ANSI_GREEN;
-    } else if (is_archive_name(name)) {
+    } else if (is_archive_name(e->name)) {
         start = ANSI_RED;
+    }
+
+    if (start[0] != '\0') {
+        ob_puts(ob, start);
+        ob_write(ob, e->name, e->name_len);
+        ob_puts(ob, ANSI_RESET);
     } else {
-        start = ""; end = "";
+        ob_write(ob, e->name, e->name_len);
     }
+}
 
-    if (start[0] != '\0') printf("%s%s%s", start, name, end);
-    else printf("%s", name);
+/*
+ * -s: allocated size in 1K blocks in front of each name and a total line
+ * per directory. With --total a directory entry shows the whole subtree
+ * below it (rolled up by libls), like du.
+ */
+static long long kblocks(blkcnt_t b) {
+    return ((long long)b + 1) / 2;
 }
 
-/* print colored name padded to col_width (visible width = name length) */
-static void print_colored_name_padded(const char *dir, const char *name, int col_width) {
-    size_t name_len = strlen(name);
-    print_colored_name_no_pad(dir, name);
-    int pad = col_width - (int)name_len;
-    if (pad < 1) pad = 1;
-    for (int i = 0; i < pad; ++i) putchar(' ');
+static blkcnt_t shown_blocks(const struct ls_entry *e) {
+    if (e->stat_err) return 0;
+    return tree_totals && S_ISDIR(e->st.st_mode) ? e->tree_blocks : e->st.st_blocks;
 }
 
-/* ---------- main ---------- */
-enum DisplayMode { DEFAULT, LONG_LIST, HORIZONTAL };
+/*
+ * Numeric columns. Every value is converted to digits straight into a
+ * small buffer (no printf); the widths of one directory are measured in a
+ * single pass over its stat'ed entries before any line is rendered, so
+ * all lines line up however large the values or long the names are.
+ */
+#define NUM_BUF         24
 
-int main(int argc, char *argv[]) {
-    int opt;
-    enum DisplayMode mode = DEFAULT;
+struct col_widths {
+    int ino, blocks;            /* -i, -s */
+    int nlink, user, group, size; /* -l */
+};
 
-    while ((opt = getopt(argc, argv, "lxR")) != -1) {
-        switch (opt) {
-            case 'l': mode = LONG_LIST; break;
-            case 'x': mode = HORIZONTAL; break;
-            case 'R': recursive_flag = 1; break;
-            default:
-                fprintf(stderr, "Usage: %s [-l] [-x] [-R] [directory...]\n", argv[0]);
-                exit(EXIT_FAILURE);
-        }
-    }
+static struct col_widths widths;
+
+/* v as decimal digits ending at end; returns the first digit */
+static char *fmt_u64(char *end, uint64_t v) {
+    do { *--end = (char)('0' + v % 10); v /= 10; } while (v);
+    return end;
+}
 
-    if (optind == argc) {
-        if (mode == LONG_LIST) do_ls_long(".");
-        else if (mode == HORIZONTAL) do_ls_horizontal(".");
-        else do_ls(".");
+/* -h: 1023, 1.0K, 9.9K, 10K, 1023K, 1.0M, ... rounded up like ls(1) */
+static size_t fmt_human(char *buf, uint64_t v) {
+    static const char units[] = "KMGTPE";
+    char *end = buf + NUM_BUF, *p;
+    if (v < 1024) {
+        p = fmt_u64(end, v);
     } else {
-        for (int i = optind; i < argc; ++i) {
-            printf("%s:\n", argv[i]);
-            if (mode == LONG_LIST) do_ls_long(argv[i]);
-            else if (mode == HORIZONTAL) do_ls_horizontal(argv[i]);
-            else do_ls(argv[i]);
-            if (recursive_flag && i < argc - 1) putchar('\n');
+        int u = 0;
+        uint64_t scale = 1024;
+        while (u < 5 && v / scale >= 1024) { scale *= 1024; u++; }
+        uint64_t whole = v / scale, rem = v % scale;
+        /* rem < scale <= 2^60, so rem * 10 + scale does not overflow */
+        uint64_t tenths = whole * 10 + (rem * 10 + scale - 1) / scale;
+        if (rem) whole++;
+        if (whole >= 1024 && u < 5) { tenths = 10; u++; }   /* 1023.1K is 1.0M */
+        if (tenths < 100) {
+            *--end = units[u];
+            *--end = (char)('0' + tenths % 10);
+            *--end = '.';
+            p = fmt_u64(end, tenths / 10);
+        } else {
+            *--end = units[u];
+            p = fmt_u64(end, whole);
         }
     }
+    size_t n = (size_t)(buf + NUM_BUF - p);
+    memmove(buf, p, n);
+    return n;
+}
 
-    return 0;
+/* plain or -h text of a count of bytes (human) or units (not human) */
+static size_t fmt_num(char *buf, uint64_t v, int human) {
+    if (human) return fmt_human(buf, v);
+    char *p = fmt_u64(buf + NUM_BUF, v);
+    size_t n = (size_t)(buf + NUM_BUF - p);
+    memmove(buf, p, n);
+    return n;
 }
 
-/* ---------- do_ls (now handles recursion when recursive_flag is set) ---------- */
-void do_ls(const char *dir) {
-    DIR *dp = opendir(dir);
-    if (!dp) {
-        perror(dir);
-        return;
-    }
+/* right-aligned in width */
+static void ob_field(struct outbuf *ob, const char *s, size_t n, int width) {
+    ob_pad(ob, width - (int)n);
+    ob_write(ob, s, n);
+}
+
+static ino_t shown_ino(const struct ls_entry *e) {
+    return e->stat_err ? e->ino : e->st.st_ino;
+}
 
-    struct dirent *entry;
-    char **files = NULL;
-    size_t count = 0, max_len = 0;
+static size_t fmt_blocks(char *buf, const struct ls_entry *e) {
+    blkcnt_t b = shown_blocks(e);
+    return human_flag ? fmt_human(buf, (uint64_t)b * 512) : fmt_num(buf, (uint64_t)kblocks(b), 0);
+}
 
-    /* read all entries */
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_name[0] == '.') continue; /* skip hidden */
-        char *dup = strdup(entry->d_name);
-        if (!dup) continue;
-        char **tmp = realloc(files, (count + 1) * sizeof(char *));
-        if (!tmp) { free(dup); break; }
-        files = tmp;
-        files[count++] = dup;
-        size_t L = strlen(dup);
-        if (L > max_len) max_len = L;
+/* owner or group name for -l, "unknown" when the id has none */
+static size_t id_text(int is_group, unsigned id, const char **name) {
+    *name = is_group ? group_name((gid_t)id) : user_name((uid_t)id);
+    if (*name) return strlen(*name);
+    *name = "unknown";
+    return 7;
+}
+
+static void set_widths(const struct ls_entry *ents, size_t n, int long_format) {
+    struct col_widths w = { 0, 0, 0, 0, 0, 0 };
+    char buf[NUM_BUF];
+    const char *name;
+    uid_t last_uid = (uid_t)-1;
+    gid_t last_gid = (gid_t)-1;
+    int uid_len = 0, gid_len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const struct ls_entry *e = &ents[i];
+        int len;
+        if (inode_flag && (len = (int)fmt_num(buf, (uint64_t)shown_ino(e), 0)) > w.ino) w.ino = len;
+        if (size_flag && (len = (int)fmt_blocks(buf, e)) > w.blocks) w.blocks = len;
+        if (!long_format || e->stat_err) continue;
+        const struct stat *st = &e->st;
+        if ((len = (int)fmt_num(buf, (uint64_t)st->st_nlink, 0)) > w.nlink) w.nlink = len;
+        /* owners repeat: only ask the id cache when the id changes */
+        if (st->st_uid != last_uid) {
+            last_uid = st->st_uid;
+            uid_len = (int)id_text(0, (unsigned)st->st_uid, &name);
+        }
+        if (st->st_gid != last_gid) {
+            last_gid = st->st_gid;
+            gid_len = (int)id_text(1, (unsigned)st->st_gid, &name);
+        }
+        if (uid_len > w.user) w.user = uid_len;
+        if (gid_len > w.group) w.group = gid_len;
+        if ((len = (int)fmt_num(buf, (uint64_t)st->st_size, human_flag)) > w.size) w.size = len;
     }
-    closedir(dp);
+    widths = w;
+}
+
+/* -i and -s columns in front of a name */
+static int prefix_width(void) {
+    return (inode_flag ? widths.ino + 1 : 0) + (size_flag ? widths.blocks + 1 : 0);
+}
 
-    if (count == 0) { free(files); return; }
+static void print_prefix(struct outbuf *ob, const struct ls_entry *e) {
+    char buf[NUM_BUF];
+    if (inode_flag) {
+        ob_field(ob, buf, fmt_num(buf, (uint64_t)shown_ino(e), 0), widths.ino);
+        ob_putc(ob, ' ');
+    }
+    if (size_flag) {
+        if (e->stat_err) ob_pad(ob, widths.blocks);
+        else ob_field(ob, buf, fmt_blocks(buf, e), widths.blocks);
+        ob_putc(ob, ' ');
+    }
+}
 
-    qsort(files, count, sizeof(char *), compare_names);
+/* print colored name padded to col_width (visible width = name length) */
+static void print_colored_name_padded(struct outbuf *ob, const struct ls_entry *e, int col_width) {
+    if (inode_flag || size_flag) {
+        print_prefix(ob, e);
+        col_width -= prefix_width();
+    }
+    print_colored_name_no_pad(ob, e);
+    int pad = col_width - (int)e->name_len;
+    if (pad < 1) pad = 1;
+    ob_pad(ob, pad);
+}
 
-    int term_width = get_terminal_width();
+/* default display: down then across */
+static void render_columns(struct outbuf *ob, const struct ls_dir *d) {
     int spacing = 2;
-    int col_width = (int)max_len + spacing;
+    int col_width = (int)d->max_len + spacing + prefix_width();
     if (col_width < 1) col_width = 1;
     int cols = term_width / col_width;
     if (cols < 1) cols = 1;
-    int rows = (int)((count + cols - 1) / cols);
+    int rows = (int)((d->count + cols - 1) / cols);
 
-    /* print this directory */
     for (int r = 0; r < rows; ++r) {
         for (int c = 0; c < cols; ++c) {
-            int idx = c * rows + r;
-            if ((size_t)idx >= count) continue;
-            print_colored_name_padded(dir, files[idx], col_width);
-        }
-        putchar('\n');
-    }
-
-    /* If recursive_flag, find subdirectories and recurse after printing current listing */
-    if (recursive_flag) {
-        for (size_t i = 0; i < count; ++i) {
-            char path[PATH_MAX];
-            if (snprintf(path, sizeof(path), "%s/%s", dir, files[i]) < 0) continue;
-            struct stat st;
-            if (lstat(path, &st) == -1) continue;
-            /* only descend if it's a directory and not a symlink */
-            if (S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)) {
-                /* skip . and .. explicitly (we already skipped hidden, but safety) */
-                if (strcmp(files[i], ".") == 0 || strcmp(files[i], "..") == 0) continue;
-                putchar('\n');
-                printf("%s:\n", path);
-                do_ls(path); /* recursive call */
+            size_t idx = (size_t)c * rows + r;
+            if (idx >= d->count) continue;
+            print_colored_name_padded(ob, &d->ents[idx], col_width);
+        }
+        ob_putc(ob, '\n');
+    }
+}
+
+/* -x: left to right, wrapping at the terminal width */
+static void render_horizontal(struct outbuf *ob, const struct ls_dir *d) {
+    int spacing = 2;
+    int col_width = (int)d->max_len + spacing + prefix_width();
+    if (col_width < 1) col_width = 1;
+
+    int current = 0;
+    for (size_t i = 0; i < d->count; ++i) {
+        if (current + col_width > term_width) {
+            ob_putc(ob, '\n');
+            current = 0;
+        }
+        print_colored_name_padded(ob, &d->ents[i], col_width);
+        current += col_width;
+    }
+    ob_putc(ob, '\n');
+}
+
+/*
+ * Huge -l listings: contiguous chunks are formatted into per-thread memory
+ * buffers and then written in order with a single writev.
+ */
+struct render_task {
+    const struct ls_dir *d;
+    size_t lo, hi;
+    struct outbuf ob;
+};
+
+static void *render_task_main(void *arg) {
+    struct render_task *t = arg;
+    for (size_t i = t->lo; i < t->hi; ++i)
+        print_file_details(&t->ob, &t->d->ents[i]);
+    return NULL;
+}
+
+/* bytes written */
+static size_t write_iov(int fd, struct iovec *iov, int n) {
+    size_t total = 0;
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        total += (size_t)w;
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return total;
+}
+
+static int render_long_parallel(struct outbuf *ob, const struct ls_dir *d) {
+    int nthreads = par_threads;
+    if (d->count < PAR_RENDER_MIN || nthreads < 2 || ob->fd < 0) return -1;
+    /* errors are reported inline, which only the sequential path can do */
+    for (size_t i = 0; i < d->count; ++i)
+        if (d->ents[i].stat_err) return -1;
+
+    struct render_task tasks[LS_MAX_THREADS];
+    for (int i = 0; i < nthreads; ++i) {
+        tasks[i].d = d;
+        tasks[i].lo = d->count * (size_t)i / (size_t)nthreads;
+        tasks[i].hi = d->count * (size_t)(i + 1) / (size_t)nthreads;
+        tasks[i].ob = (struct outbuf){ -1, NULL, 0, 0, 0 };
+    }
+    ls_run_tasks(render_task_main, tasks, sizeof(tasks[0]), nthreads);
+
+    struct iovec iov[LS_MAX_THREADS];
+    for (int i = 0; i < nthreads; ++i) {
+        iov[i].iov_base = tasks[i].ob.buf;
+        iov[i].iov_len = tasks[i].ob.len;
+    }
+    ob_flush(ob);
+    ob->written += write_iov(ob->fd, iov, nthreads);
+    for (int i = 0; i < nthreads; ++i) ob_free(&tasks[i].ob);
+    return 0;
+}
+
+static void render_long(struct outbuf *ob, const struct ls_dir *d) {
+    if (render_long_parallel(ob, d) == 0) return;
+    for (size_t i = 0; i < d->count; ++i)
+        print_file_details(ob, &d->ents[i]);
+}
+
+/* the listing itself, without the header */
+static void render_body(struct outbuf *ob, const struct ls_dir *d) {
+    if (size_flag || inode_flag || display_mode == LONG_LIST)
+        set_widths(d->ents, d->count, display_mode == LONG_LIST);
+    if (size_flag || display_mode == LONG_LIST) {
+        char buf[NUM_BUF];
+        blkcnt_t b = tree_totals ? d->tree_blocks : d->blocks;
+        ob_puts(ob, "total ");
+        if (human_flag) ob_write(ob, buf, fmt_human(buf, (uint64_t)b * 512));
+        else ob_write(ob, buf, fmt_num(buf, (uint64_t)kblocks(b), 0));
+        ob_putc(ob, '\n');
+    }
+    if (d->count == 0) return;
+
+    if (display_mode == LONG_LIST) render_long(ob, d);
+    else if (display_mode == HORIZONTAL) render_horizontal(ob, d);
+    else render_columns(ob, d);
+}
+
+/* header / separator rules match the sequential v1.6.0 output */
+static void render_header(struct outbuf *ob, const struct ls_dir *d, int print_headers, int *first_root) {
+    if (d->is_root) {
+        if (print_headers) {
+            if (!*first_root && recursive_flag) ob_putc(ob, '\n');
+            ob_puts(ob, d->path);
+            ob_puts(ob, ":\n");
+        }
+        *first_root = 0;
+    } else {
+        /* --total hands out subdirectories before their root */
+        if (!*first_root) ob_putc(ob, '\n');
+        *first_root = 0;
+        ob_puts(ob, d->path);
+        ob_puts(ob, ":\n");
+    }
+}
+
+static void render_dir(struct outbuf *ob, const struct ls_dir *d, int print_headers, int *first_root) {
+    render_header(ob, d, print_headers, first_root);
+    if (d->err) { report_error(d->path, d->err); return; }
+    render_body(ob, d);
+}
+
+/*
+ * Snapshots (--save-snapshot / --diff). A snapshot is the walk's directory
+ * tables in walk order: a file header, then per directory a block header,
+ * its path, the entry records (same layout as the cache) and a name blob.
+ * Directories come out of the walk ordered by argument and then by path
+ * component, and entries within a directory by name, so --diff compares a
+ * live walk against a snapshot with a streaming merge-join that holds one
+ * directory from each side at a time.
+ */
+#define SNAP_MAGIC      0x3153534cu     /* "LSS1" */
+
+struct snap_header {
+    uint32_t magic, version, rec_size, pad;
+};
+
+struct snap_dir {
+    int32_t err;
+    uint32_t root_idx;
+    uint32_t path_len, pad;
+    uint64_t count, names_size;
+};
+
+static FILE *snap_out;          /* --save-snapshot */
+static FILE *snap_in;           /* --diff */
+
+static void snap_write_dir(const struct ls_dir *d) {
+    struct snap_dir h = { 0 };
+    h.err = d->err;
+    h.root_idx = (uint32_t)d->root_idx;
+    h.path_len = (uint32_t)strlen(d->path);
+    h.count = d->count;
+    for (size_t i = 0; i < d->count; ++i) h.names_size += d->ents[i].name_len + 1;
+    fwrite(&h, sizeof(h), 1, snap_out);
+    fwrite(d->path, 1, h.path_len, snap_out);
+
+    uint32_t off = 0;
+    for (size_t i = 0; i < d->count; ++i) {
+        struct ls_rec r;
+        ls_rec_from_entry(&r, &d->ents[i], off);
+        fwrite(&r, sizeof(r), 1, snap_out);
+        off += (uint32_t)d->ents[i].name_len + 1;
+    }
+    for (size_t i = 0; i < d->count; ++i)
+        fwrite(d->ents[i].name, 1, d->ents[i].name_len + 1, snap_out);
+}
+
+/* one directory read back from a snapshot */
+struct snap_block {
+    int valid;
+    int root_idx;
+    char *path;
+    char *names;
+    struct ls_entry *ents;
+    size_t count;
+};
+
+static void snap_block_clear(struct snap_block *b) {
+    free(b->path);
+    free(b->names);
+    free(b->ents);
+    memset(b, 0, sizeof(*b));
+}
+
+static int snap_read_block(struct snap_block *b) {
+    snap_block_clear(b);
+    struct snap_dir h;
+    if (fread(&h, sizeof(h), 1, snap_in) != 1) return -1;
+    if (h.count > SIZE_MAX / sizeof(struct ls_rec) || h.names_size > SIZE_MAX - 1) return -1;
+
+    struct ls_rec *recs = malloc(h.count * sizeof(*recs) + 1);
+    b->path = malloc((size_t)h.path_len + 1);
+    b->names = malloc((size_t)h.names_size + 1);
+    b->ents = malloc(h.count * sizeof(struct ls_entry) + 1);
+    int ok = recs && b->path && b->names && b->ents &&
+             fread(b->path, 1, h.path_len, snap_in) == h.path_len &&
+             fread(recs, sizeof(*recs), h.count, snap_in) == h.count &&
+             fread(b->names, 1, h.names_size, snap_in) == h.names_size;
+    for (size_t i = 0; ok && i < h.count; ++i) {
+        ok = ls_rec_name_ok(&recs[i], b->names, h.names_size);
+        if (ok) ls_entry_from_rec(&b->ents[i], &recs[i], b->names);
+    }
+    free(recs);
+    if (!ok) { snap_block_clear(b); return -1; }
+    b->path[h.path_len] = '\0';
+    b->count = h.count;
+    b->root_idx = (int)h.root_idx;
+    b->valid = 1;
+    return 0;
+}
+
+/* walk order of two paths under the same root when names sort by LC_COLLATE */
+static int compare_components_coll(const char *a, const char *b) {
+    for (;;) {
+        size_t la = strcspn(a, "/"), lb = strcspn(b, "/");
+        if (la != lb || memcmp(a, b, la) != 0) {
+            char ca[NAME_MAX + 1], cb[NAME_MAX + 1];
+            if (la > NAME_MAX || lb > NAME_MAX) {
+                int c = memcmp(a, b, la < lb ? la : lb);
+                return c ? c : la < lb ? -1 : 1;
             }
+            memcpy(ca, a, la);
+            ca[la] = '\0';
+            memcpy(cb, b, lb);
+            cb[lb] = '\0';
+            return ls_compare_names(ca, cb, 1);
         }
+        a += la;
+        b += lb;
+        if (!*a || !*b) return (*a != '\0') - (*b != '\0');
+        a++;
+        b++;
+    }
+}
+
+/* walk order of two directories: argument first, then component by component */
+static int compare_walk_order(int ra, const char *a, int rb, const char *b) {
+    if (ra != rb) return ra < rb ? -1 : 1;
+    if (collate_flag) return compare_components_coll(a, b);
+    for (;; ++a, ++b) {
+        /* end of path < separator < any name byte */
+        int ca = *a == '\0' ? 0 : *a == '/' ? 1 : (unsigned char)*a + 2;
+        int cb = *b == '\0' ? 0 : *b == '/' ? 1 : (unsigned char)*b + 2;
+        if (ca != cb) return ca < cb ? -1 : 1;
+        if (ca == 0) return 0;
+    }
+}
+
+static void diff_line(char tag, const char *dir, const struct ls_entry *e, const char *what) {
+    ob_putc(&out, tag);
+    ob_putc(&out, ' ');
+    ob_puts(&out, dir);
+    ob_putc(&out, '/');
+    ob_write(&out, e->name, e->name_len);
+    if (what) {
+        ob_puts(&out, " (");
+        ob_puts(&out, what);
+        ob_putc(&out, ')');
     }
+    ob_putc(&out, '\n');
+}
 
-    for (size_t i = 0; i < count; ++i) free(files[i]);
-    free(files);
+static void diff_changed(const char *dir, const struct ls_entry *old, const struct ls_entry *cur) {
+    char what[96] = "";
+    const struct stat *a = &old->st, *b = &cur->st;
+    if ((a->st_mode & S_IFMT) != (b->st_mode & S_IFMT)) strcat(what, "type ");
+    else if (a->st_mode != b->st_mode) strcat(what, "mode ");
+    if (a->st_uid != b->st_uid || a->st_gid != b->st_gid) strcat(what, "owner ");
+    if (a->st_size != b->st_size) strcat(what, "size ");
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec || a->st_mtim.tv_nsec != b->st_mtim.tv_nsec)
+        strcat(what, "mtime ");
+    if (a->st_ino != b->st_ino) strcat(what, "inode ");
+    if (old->stat_err != cur->stat_err) strcat(what, "stat ");
+    if (what[0] == '\0') return;
+    what[strlen(what) - 1] = '\0';
+    diff_line('~', dir, cur, what);
 }
 
-/* ---------- Horizontal display (left-to-right) ---------- */
-void do_ls_horizontal(const char *dir) {
-    DIR *dp = opendir(dir);
-    if (!dp) { perror(dir); return; }
+static int cmp_entry_ptrs(const void *a, const void *b) {
+    return strcmp((*(const struct ls_entry *const *)a)->name, (*(const struct ls_entry *const *)b)->name);
+}
 
-    struct dirent *entry;
-    char **files = NULL;
-    size_t count = 0, max_len = 0;
+/* byte-ordered view of a table, so the join does not depend on the sort key */
+static const struct ls_entry **byte_order(const struct ls_entry *ents, size_t n) {
+    const struct ls_entry **v = malloc((n ? n : 1) * sizeof(*v));
+    if (!v) return NULL;
+    for (size_t i = 0; i < n; ++i) v[i] = &ents[i];
+    qsort(v, n, sizeof(*v), cmp_entry_ptrs);
+    return v;
+}
 
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_name[0] == '.') continue;
-        char *dup = strdup(entry->d_name);
-        if (!dup) continue;
-        char **tmp = realloc(files, (count + 1) * sizeof(char*));
-        if (!tmp) { free(dup); break; }
-        files = tmp;
-        files[count++] = dup;
-        size_t L = strlen(dup);
-        if (L > max_len) max_len = L;
+/* merge-join one directory; either side may be empty (NULL, 0) */
+static void diff_tables(const char *dir, const struct ls_entry *old, size_t nold,
+                        const struct ls_entry *cur, size_t ncur) {
+    const struct ls_entry **a = byte_order(old, nold), **b = byte_order(cur, ncur);
+    if (!a || !b) { free(a); free(b); return; }
+    size_t i = 0, j = 0;
+    while (i < nold || j < ncur) {
+        int c = i == nold ? 1 : j == ncur ? -1 : strcmp(a[i]->name, b[j]->name);
+        if (c < 0) diff_line('-', dir, a[i++], NULL);
+        else if (c > 0) diff_line('+', dir, b[j++], NULL);
+        else diff_changed(dir, a[i++], b[j++]);
     }
-    closedir(dp);
+    free(a);
+    free(b);
+}
 
-    if (count == 0) { free(files); return; }
+static struct snap_block snap_cur;
 
-    qsort(files, count, sizeof(char*), compare_names);
+/* snapshot directories that sort before (root, path) are gone */
+static void diff_drain_until(int root_idx, const char *path) {
+    while (snap_cur.valid &&
+           (!path || compare_walk_order(snap_cur.root_idx, snap_cur.path, root_idx, path) < 0)) {
+        diff_tables(snap_cur.path, snap_cur.ents, snap_cur.count, NULL, 0);
+        snap_read_block(&snap_cur);
+    }
+}
 
-    int term_width = get_terminal_width();
-    int spacing = 2;
-    int col_width = (int)max_len + spacing;
-    if (col_width < 1) col_width = 1;
+static void diff_dir(const struct ls_dir *d) {
+    diff_drain_until(d->root_idx, d->path);
+    const struct ls_entry *cur = d->err ? NULL : d->ents;
+    size_t ncur = d->err ? 0 : d->count;
+    if (snap_cur.valid && snap_cur.root_idx == d->root_idx && strcmp(snap_cur.path, d->path) == 0) {
+        diff_tables(d->path, snap_cur.ents, snap_cur.count, cur, ncur);
+        snap_read_block(&snap_cur);
+    } else {
+        diff_tables(d->path, NULL, 0, cur, ncur);
+    }
+    if (d->err) report_error(d->path, d->err);
+}
 
-    int current = 0;
-    for (size_t i = 0; i < count; ++i) {
-        size_t name_len = strlen(files[i]);
-        if (current + col_width > term_width) {
-            putchar('\n');
-            current = 0;
+static int snap_open_input(const char *path) {
+    snap_in = fopen(path, "rb");
+    struct snap_header h;
+    if (!snap_in || fread(&h, sizeof(h), 1, snap_in) != 1 ||
+        h.magic != SNAP_MAGIC || h.rec_size != sizeof(struct ls_rec)) {
+        fprintf(stderr, "%s: not a snapshot file\n", path);
+        return -1;
+    }
+    snap_read_block(&snap_cur);
+    return 0;
+}
+
+static int snap_open_output(const char *path) {
+    snap_out = fopen(path, "wb");
+    if (!snap_out) { perror(path); return -1; }
+    struct snap_header h = { SNAP_MAGIC, 1, sizeof(struct ls_rec), 0 };
+    fwrite(&h, sizeof(h), 1, snap_out);
+    return 0;
+}
+
+/*
+ * --format=ndjson: one JSON object per entry, written straight from the
+ * entry table into the output buffer, one directory at a time so -R
+ * streams. Names are arbitrary bytes; valid UTF-8 passes through and any
+ * other byte is written as \u00XX.
+ */
+enum OutputFormat { FMT_TEXT, FMT_NDJSON, FMT_BIN };
+static enum OutputFormat output_format = FMT_TEXT;
+
+/* length of the valid UTF-8 sequence at s, 0 if invalid */
+static size_t utf8_seq(const unsigned char *s, size_t left) {
+    unsigned char c = s[0];
+    size_t n;
+    uint32_t cp;
+    if (c < 0x80) return 1;
+    if (c >= 0xc2 && c <= 0xdf) { n = 2; cp = c & 0x1f; }
+    else if (c >= 0xe0 && c <= 0xef) { n = 3; cp = c & 0x0f; }
+    else if (c >= 0xf0 && c <= 0xf4) { n = 4; cp = c & 0x07; }
+    else return 0;
+    if (left < n) return 0;
+    for (size_t i = 1; i < n; ++i) {
+        if ((s[i] & 0xc0) != 0x80) return 0;
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    if ((n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) || (n == 4 && (cp < 0x10000 || cp > 0x10ffff)))
+        return 0;
+    return n;
+}
+
+static void json_string_body(struct outbuf *ob, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)s;
+    size_t run = 0;             /* bytes that can be copied as they are */
+    for (size_t i = 0; i < len;) {
+        unsigned char c = p[i];
+        size_t n = c >= 0x20 && c != '"' && c != '\\' ? utf8_seq(p + i, len - i) : 0;
+        if (n) { i += n; run += n; continue; }
+        ob_write(ob, s + i - run, run);
+        run = 0;
+        if (c == '"') ob_puts(ob, "\\\"");
+        else if (c == '\\') ob_puts(ob, "\\\\");
+        else if (c == '\n') ob_puts(ob, "\\n");
+        else if (c == '\t') ob_puts(ob, "\\t");
+        else {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            ob_write(ob, esc, sizeof(esc));
         }
-        print_colored_name_no_pad(dir, files[i]);
-        int pad = col_width - (int)name_len;
-        if (pad < 1) pad = 1;
-        for (int p = 0; p < pad; ++p) putchar(' ');
-        current += col_width;
+        ++i;
+    }
+    ob_write(ob, s + len - run, run);
+}
+
+static void json_key(struct outbuf *ob, const char *key, int first) {
+    if (!first) ob_putc(ob, ',');
+    ob_putc(ob, '"');
+    ob_puts(ob, key);
+    ob_puts(ob, "\":");
+}
+
+static void json_str(struct outbuf *ob, const char *key, const char *s, size_t len) {
+    json_key(ob, key, 0);
+    ob_putc(ob, '"');
+    json_string_body(ob, s, len);
+    ob_putc(ob, '"');
+}
+
+static void json_u64(struct outbuf *ob, const char *key, uint64_t v) {
+    json_key(ob, key, 0);
+    ob_u64(ob, v);
+}
+
+static const char *type_name(mode_t m) {
+    return S_ISREG(m) ? "file" : S_ISDIR(m) ? "dir" : S_ISLNK(m) ? "symlink" :
+           S_ISCHR(m) ? "char" : S_ISBLK(m) ? "block" : S_ISFIFO(m) ? "fifo" :
+           S_ISSOCK(m) ? "socket" : "unknown";
+}
+
+static void render_ndjson(struct outbuf *ob, const struct ls_dir *d) {
+    size_t dl = strlen(d->path);
+    for (size_t i = 0; i < d->count; ++i) {
+        const struct ls_entry *e = &d->ents[i];
+        const struct stat *st = &e->st;
+        ob_putc(ob, '{');
+        json_key(ob, "path", 1);
+        ob_putc(ob, '"');
+        json_string_body(ob, d->path, dl);
+        ob_putc(ob, '/');
+        json_string_body(ob, e->name, e->name_len);
+        ob_putc(ob, '"');
+        if (e->stat_err) {
+            const char *msg = strerror(e->stat_err);
+            json_str(ob, "error", msg, strlen(msg));
+            ob_puts(ob, "}\n");
+            continue;
+        }
+        const char *type = type_name(st->st_mode);
+        json_str(ob, "type", type, strlen(type));
+        char mode[4];
+        for (int k = 0; k < 4; ++k) mode[k] = (char)('0' + ((st->st_mode >> (9 - 3 * k)) & 7));
+        json_str(ob, "mode", mode, sizeof(mode));
+        json_u64(ob, "size", (uint64_t)st->st_size);
+        json_u64(ob, "nlink", (uint64_t)st->st_nlink);
+        json_u64(ob, "uid", (uint64_t)st->st_uid);
+        json_u64(ob, "gid", (uint64_t)st->st_gid);
+        const char *user = user_name(st->st_uid), *group = group_name(st->st_gid);
+        if (user) json_str(ob, "user", user, strlen(user));
+        if (group) json_str(ob, "group", group, strlen(group));
+        json_key(ob, "mtime_ns", 0);
+        ob_i64(ob, (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec);
+        json_u64(ob, "ino", (uint64_t)st->st_ino);
+        ob_puts(ob, "}\n");
+    }
+}
+
+/*
+ * --format=bin: one columnar block per directory, laid out as described
+ * in lsbin.h. Each column is a pass over the same entry table the text
+ * renderers use.
+ */
+static void ob_zero(struct outbuf *ob, size_t n) {
+    static const char zeros[8];
+    ob_write(ob, zeros, n);
+}
+
+static void render_bin(struct outbuf *ob, const struct ls_dir *d) {
+    size_t n = d->err ? 0 : d->count, names_len = 0;
+    for (size_t i = 0; i < n; ++i) names_len += d->ents[i].name_len + 1;
+    struct lsbin_block b = { 0 };
+    b.magic = LSBIN_BLOCK_MAGIC;
+    b.count = (uint32_t)n;
+    b.path_len = (uint32_t)strlen(d->path);
+    b.names_len = (uint32_t)names_len;
+    b.dir_err = d->err;
+    b.block_len = lsbin_block_size(b.count, b.path_len, b.names_len);
+    ob_write(ob, (const char *)&b, sizeof(b));
+    ob_write(ob, d->path, b.path_len);
+    ob_zero(ob, LSBIN_ALIGN(b.path_len) - b.path_len);
+
+    /* d_ino is known even when the stat failed */
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t v = (uint64_t)d->ents[i].ino;
+        ob_write(ob, (const char *)&v, sizeof(v));
+    }
+#define BIN_COLUMN(type, expr) \
+    for (size_t i = 0; i < n; ++i) { \
+        const struct ls_entry *e = &d->ents[i]; \
+        type v = e->stat_err ? 0 : (type)(expr); \
+        ob_write(ob, (const char *)&v, sizeof(v)); \
+    }
+    BIN_COLUMN(uint64_t, e->st.st_size)
+    BIN_COLUMN(int64_t, (int64_t)e->st.st_mtim.tv_sec * 1000000000 + e->st.st_mtim.tv_nsec)
+    BIN_COLUMN(uint32_t, e->st.st_mode)
+    BIN_COLUMN(uint32_t, e->st.st_uid)
+    BIN_COLUMN(uint32_t, e->st.st_gid)
+    BIN_COLUMN(uint32_t, e->st.st_nlink)
+#undef BIN_COLUMN
+    for (size_t i = 0; i < n; ++i) {
+        int32_t v = d->ents[i].stat_err;
+        ob_write(ob, (const char *)&v, sizeof(v));
+    }
+    uint32_t off = 0;
+    for (size_t i = 0; i <= n; ++i) {
+        ob_write(ob, (const char *)&off, sizeof(off));
+        if (i < n) off += (uint32_t)d->ents[i].name_len + 1;
+    }
+    size_t cols32 = (n * 6 + 1) * 4;
+    ob_zero(ob, LSBIN_ALIGN(cols32) - cols32);
+    for (size_t i = 0; i < n; ++i)
+        ob_write(ob, d->ents[i].name, d->ents[i].name_len + 1);
+    ob_zero(ob, LSBIN_ALIGN(names_len) - names_len);
+}
+
+/* where finished batches go: the terminal, a snapshot, or the diff */
+static void consume_dir(const struct ls_dir *d, int print_headers, int *first_root) {
+    if (snap_out) {
+        snap_write_dir(d);
+        if (d->err) report_error(d->path, d->err);
+    } else if (snap_in) {
+        diff_dir(d);
+    } else if (output_format == FMT_BIN) {
+        if (d->err) report_error(d->path, d->err);
+        render_bin(&out, d);
+    } else if (output_format == FMT_NDJSON) {
+        if (d->err) report_error(d->path, d->err);
+        else render_ndjson(&out, d);
+    } else {
+        render_dir(&out, d, print_headers, first_root);
+    }
+}
+
+/*
+ * --checkpoint FILE: every CHECKPOINT_SECS, between two directories, the
+ * output is flushed and FILE is replaced (write, rename) with where the
+ * listing stands: the directory last written, its root and the bytes of
+ * output so far. Directories are written in walk order, so the last one
+ * is all libls needs to rebuild the pending part of the walk
+ * (resume_after). --resume FILE continues from there and keeps
+ * checkpointing into FILE. If stdout is a regular file it is first cut
+ * back to the recorded size, dropping a partly written directory, so the
+ * file ends up exactly as one uninterrupted run would have left it; other
+ * outputs continue at that byte. A checkpoint only resumes the same
+ * arguments in the same directory, and is removed once the listing ends.
+ *
+ * File: "LSCK1", then "args <hash>", "root <n>", "offset <bytes>" and
+ * "path <len>" lines, then the path bytes and a newline.
+ */
+#define CHECKPOINT_SECS 5
+
+static const char *checkpoint_path;
+static uint64_t args_hash;      /* of the working directory and the parsed options */
+
+static struct {
+    int root;
+    uint64_t offset;
+    char *path;                 /* NULL: not resuming */
+} resume_point;
+
+static uint64_t out_base;       /* output written before this run */
+
+static uint64_t hash_str(uint64_t h, const char *s) {
+    for (;; ++s) {
+        h = (h ^ (unsigned char)*s) * 1099511628211ull;
+        if (!*s) return h;
+    }
+}
+
+static uint64_t hash_u64(uint64_t h, uint64_t v) {
+    for (int i = 0; i < 8; ++i, v >>= 8) h = (h ^ (v & 0xff)) * 1099511628211ull;
+    return h;
+}
+
+/*
+ * FNV-1a over what shapes the output besides the tree: the cwd, terminal
+ * width, collation locale, the parsed output and walk options and the
+ * roots. Options are hashed by value, not as spelled, so "--max-dep=2"
+ * resumes "--max-depth 2"; those that only change how the walk runs
+ * (--cache, --dir-timeout, the rate limits, --stats) are left out, so a
+ * resumed run may be paced differently.
+ */
+static uint64_t hash_args(char **roots, int nroots) {
+    uint64_t h = 14695981039346656037ull;
+    char *cwd = getcwd(NULL, 0);
+    h = hash_str(h, cwd ? cwd : "");
+    free(cwd);
+    const char *coll = setlocale(LC_COLLATE, NULL);
+    h = hash_str(h, coll ? coll : "");
+    const uint64_t flags[] = {
+        (uint64_t)term_width, (uint64_t)display_mode, (uint64_t)output_format, (uint64_t)recursive_flag,
+        (uint64_t)size_flag, (uint64_t)inode_flag, (uint64_t)human_flag, (uint64_t)follow_flag,
+        (uint64_t)one_fs_flag, (uint64_t)gitignore_flag, (uint64_t)max_depth,
+    };
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i) h = hash_u64(h, flags[i]);
+    h = hash_u64(h, nhide);
+    for (size_t i = 0; i < nhide; ++i) h = hash_str(h, hide_pats[i]);
+    h = hash_u64(h, filter.count);
+    for (size_t i = 0; i < filter.count; ++i) {
+        const struct ls_pred *p = &filter.preds[i];
+        h = hash_u64(h, (uint64_t)p->test);
+        h = hash_u64(h, (uint64_t)p->type);
+        h = hash_str(h, p->glob ? p->glob : "");
+        h = hash_u64(h, (uint64_t)p->cmp);
+        h = hash_u64(h, (uint64_t)p->size);
+        h = hash_u64(h, (uint64_t)p->time.tv_sec);
+        h = hash_u64(h, (uint64_t)p->time.tv_nsec);
+    }
+    h = hash_u64(h, (uint64_t)nroots);
+    for (int i = 0; i < nroots; ++i) h = hash_str(h, roots[i]);
+    return h;
+}
+
+static void checkpoint_save(const struct ls_dir *d) {
+    ob_flush(&out);
+    struct stat st;
+    /* the output the checkpoint vouches for must be on disk before it is */
+    if (fstat(out.fd, &st) == 0 && S_ISREG(st.st_mode)) fdatasync(out.fd);
+
+    size_t pl = strlen(checkpoint_path);
+    char *tmp = malloc(pl + 5);
+    if (!tmp) return;
+    memcpy(tmp, checkpoint_path, pl);
+    memcpy(tmp + pl, ".tmp", 5);
+    FILE *f = fopen(tmp, "w");
+    if (!f) { perror(tmp); free(tmp); return; }
+    fprintf(f, "LSCK1\nargs %016llx\nroot %d\noffset %llu\npath %zu\n", (unsigned long long)args_hash,
+            d->root_idx, (unsigned long long)(out_base + out.written), strlen(d->path));
+    fputs(d->path, f);
+    fputc('\n', f);
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, checkpoint_path) != 0) {
+        perror(checkpoint_path);
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+static void checkpoint_tick(const struct ls_dir *d) {
+    static time_t last;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!last) last = now.tv_sec;
+    if (now.tv_sec - last < CHECKPOINT_SECS) return;
+    last = now.tv_sec;
+    checkpoint_save(d);
+}
+
+/* read FILE into resume_point and put stdout where it left off */
+static void resume_load(const char *prog, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); exit(EXIT_FAILURE); }
+    unsigned long long hash, offset;
+    size_t len;
+    int root;
+    char *p = NULL;
+    if (fscanf(f, "LSCK1 args %llx root %d offset %llu path %zu", &hash, &root, &offset, &len) == 4 &&
+        fgetc(f) == '\n' && len < (1u << 20) && (p = malloc(len + 1)) != NULL && fread(p, 1, len, f) == len) {
+        p[len] = '\0';
+    } else {
+        fprintf(stderr, "%s: %s: not a checkpoint\n", prog, path);
+        exit(EXIT_FAILURE);
     }
-    putchar('\n');
-
-    /* recursion after horizontal listing */
-    if (recursive_flag) {
-        for (size_t i = 0; i < count; ++i) {
-            char path[PATH_MAX];
-            if (snprintf(path, sizeof(path), "%s/%s", dir, files[i]) < 0) continue;
-            struct stat st;
-            if (lstat(path, &st) == -1) continue;
-            if (S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)) {
-                if (strcmp(files[i], ".") == 0 || strcmp(files[i], "..") == 0) continue;
-                putchar('\n');
-                printf("%s:\n", path);
-                do_ls(path);
+    fclose(f);
+    if (hash != args_hash) {
+        fprintf(stderr, "%s: %s: checkpoint of a different command or directory\n", prog, path);
+        exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+        if ((unsigned long long)st.st_size < offset) {
+            fprintf(stderr, "%s: output is shorter than the checkpoint (%llu bytes)\n", prog, offset);
+            exit(EXIT_FAILURE);
+        }
+        if (ftruncate(STDOUT_FILENO, (off_t)offset) != 0 || lseek(STDOUT_FILENO, (off_t)offset, SEEK_SET) < 0) {
+            perror("resume");
+            exit(EXIT_FAILURE);
+        }
+    }
+    resume_point.root = root;
+    resume_point.offset = offset;
+    resume_point.path = p;
+    out_base = offset;
+}
+
+/* library settings from the command line */
+static struct ls_options list_options(void) {
+    struct ls_options opt = { 0 };
+    opt.recursive = recursive_flag;
+    opt.max_depth = max_depth;
+    opt.one_fs = one_fs_flag;
+    opt.follow_links = follow_flag;
+    opt.stat_order = stat_order;
+    opt.collate = collate_flag;
+    opt.cache_dir = cache_dir;
+    opt.threads = par_threads;
+    opt.tree_totals = tree_totals;
+    opt.filter = filter.count ? &filter : NULL;
+    opt.hide = hide_pats;
+    opt.nhide = nhide;
+    opt.gitignore = gitignore_flag;
+    opt.dir_timeout = dir_timeout;
+    opt.max_iops = max_iops;
+    opt.max_dirs_per_sec = max_dirs_per_sec;
+    opt.count = count_mode;
+    opt.sample_buffers = sample_buffers;
+    return opt;
+}
+
+/* walk the given roots through libls and consume each finished directory */
+static void run_listing(char **roots, int nroots, int print_headers) {
+    struct ls_options opt = list_options();
+    /* post-order output: without headers the root's listing would be unlabelled */
+    if (tree_totals && recursive_flag) print_headers = 1;
+    opt.resume_after = resume_point.path;
+    opt.resume_root = resume_point.root;
+    struct ls_iter *it = ls_iter_open(roots, nroots, &opt);
+    if (!it) {
+        if (resume_point.path && errno == EINVAL)
+            fprintf(stderr, "ls: %s is not under the listed directories\n", resume_point.path);
+        else
+            perror("ls_iter_open");
+        exit(EXIT_FAILURE);
+    }
+
+    /* a resumed listing already has its first directory */
+    int first_root = !resume_point.path, cur_root = 0;
+    const struct ls_dir *d;
+    while ((d = ls_iter_next(it)) != NULL) {
+        /* hand finished output to the terminal while later roots are read */
+        if (d->root_idx != cur_root) { ob_flush(&out); cur_root = d->root_idx; }
+        consume_dir(d, print_headers, &first_root);
+        if (checkpoint_path) checkpoint_tick(d);
+    }
+    ob_flush(&out);
+    /* done: nothing left to resume */
+    if (checkpoint_path) unlink(checkpoint_path);
+
+    struct ls_stats st;
+    ls_iter_stats(it, &st);
+    ls_iter_close(it);
+    walk_totals.fd_budget = st.fd_budget;
+    walk_totals.opens += st.opens;
+    walk_totals.relative += st.relative;
+    walk_totals.evictions += st.evictions;
+    walk_totals.reopens += st.reopens;
+    walk_totals.cache_hits += st.cache_hits;
+    walk_totals.cache_misses += st.cache_misses;
+    walk_totals.timeouts += st.timeouts;
+}
+
+/*
+ * --top=K: walk the whole tree below the roots and print only the K
+ * largest (or newest) regular files, best first, in -l format with their
+ * paths. libls keeps the candidates in per-thread heaps, so nothing else
+ * is held and the batches are drained without being rendered.
+ */
+static void run_top(char **roots, int nroots) {
+    struct ls_options opt = list_options();
+    opt.recursive = 1;
+    opt.top_k = top_k;
+    opt.top_by = top_by;
+    struct ls_iter *it = ls_iter_open(roots, nroots, &opt);
+    if (!it) { perror("ls_iter_open"); exit(EXIT_FAILURE); }
+
+    const struct ls_dir *d;
+    while ((d = ls_iter_next(it)) != NULL)
+        if (d->err) report_error(d->path, d->err);
+
+    size_t n;
+    const struct ls_entry *win = ls_iter_top(it, &n);
+    set_widths(win, n, 1);
+    for (size_t i = 0; i < n; ++i) print_file_details(&out, &win[i]);
+    ob_flush(&out);
+    ls_iter_close(it);
+}
+
+/*
+ * --count / --estimate: one line per root with the number of names in it,
+ * or with -R in its whole subtree, from getdents alone: "N root", "~N" when
+ * any part was extrapolated. With --count=types the total is split by
+ * d_type, also with --estimate; names whose type the filesystem does not
+ * report are "unknown".
+ */
+struct count_total {
+    double n[16];
+    int estimated;
+};
+
+static void print_count(const char *root, const struct count_total *t) {
+    static const struct { int type; const char *name; } kinds[] = {
+        { DT_REG, "files" }, { DT_DIR, "dirs" }, { DT_LNK, "links" }, { DT_FIFO, "fifos" },
+        { DT_SOCK, "sockets" }, { DT_CHR, "chardevs" }, { DT_BLK, "blockdevs" }, { DT_UNKNOWN, "unknown" },
+    };
+    double sum = 0;
+    for (int i = 0; i < 16; ++i) sum += t->n[i];
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%s%.0f ", t->estimated ? "~" : "", sum);
+    ob_write(&out, buf, (size_t)len);
+    ob_write(&out, root, strlen(root));
+    if (count_types) {
+        const char *sep = " (";
+        for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); ++i) {
+            if (!t->n[kinds[i].type]) continue;
+            len = snprintf(buf, sizeof(buf), "%s%s %.0f", sep, kinds[i].name, t->n[kinds[i].type]);
+            ob_write(&out, buf, (size_t)len);
+            sep = ", ";
+        }
+        if (*sep == ',') ob_putc(&out, ')');
+    }
+    ob_putc(&out, '\n');
+}
+
+static void run_count(char **roots, int nroots) {
+    struct ls_options opt = list_options();
+    struct ls_iter *it = ls_iter_open(roots, nroots, &opt);
+    if (!it) { perror("ls_iter_open"); exit(EXIT_FAILURE); }
+
+    struct count_total t = { { 0 }, 0 };
+    int cur_root = 0;
+    const struct ls_dir *d;
+    while ((d = ls_iter_next(it)) != NULL) {
+        if (d->root_idx != cur_root) {
+            print_count(roots[cur_root], &t);
+            memset(&t, 0, sizeof(t));
+            cur_root = d->root_idx;
+        }
+        if (d->err) report_error(d->path, d->err);
+        for (int i = 0; i < 16; ++i) t.n[i] += (double)d->counts[i] * d->weight;
+        t.estimated |= d->estimated || d->weight > 1;
+    }
+    print_count(roots[cur_root], &t);
+    ob_flush(&out);
+
+    struct ls_stats st;
+    ls_iter_stats(it, &st);
+    ls_iter_close(it);
+    walk_totals.fd_budget = st.fd_budget;
+    walk_totals.opens += st.opens;
+    walk_totals.relative += st.relative;
+    walk_totals.evictions += st.evictions;
+    walk_totals.reopens += st.reopens;
+    walk_totals.timeouts += st.timeouts;
+}
+
+/* ---------- listing daemon (--serve / --client) ---------- */
+
+/*
+ * --serve SOCKET keeps every directory it has listed as a sorted, stat'ed
+ * entry table, keyed by absolute path, and watches it with inotify. Any
+ * change in a directory drops its table (and, for renamed or deleted
+ * subdirectories, the tables below them); one that changes the
+ * directory's own inode also drops its parent's, whose row for it is now
+ * stale. The next request re-reads only what changed. --client SOCKET sends its options, terminal width,
+ * working directory and arguments, and copies the rendered bytes back.
+ * fanotify would need CAP_SYS_ADMIN, so only inotify is used.
+ *
+ * Request:  a 4-byte big-endian length, then
+ *           "LSQ2" NUL mode NUL recursive NUL width NUL cwd NUL args... ,
+ *           where mode is the display mode plus the RENDER_* flag bits.
+ *           The daemon serves one client at a time, so each read and
+ *           write on a client gives up after SERVE_TIMEOUT_MS.
+ * Response: frames of one tag byte ('o' stdout, 'e' stderr, 'x' the
+ *           request was refused), a 4-byte length and the payload.
+ * The daemon lists with its own walk and cache, so the walk options that
+ * would change the tables (-L, -I, --gitignore, --max-depth,
+ * --one-file-system) are refused on both ends rather than ignored.
+ */
+#define SERVE_BUCKETS   4096
+#define SERVE_TIMEOUT_MS 2000
+#define SERVE_MAX_REQUEST (1 << 20)
+#define RENDER_SIZE     16      /* -s */
+#define RENDER_INODE    32      /* -i */
+#define RENDER_HUMAN    64      /* -h */
+#define RENDER_FLAGS    (RENDER_SIZE | RENDER_INODE | RENDER_HUMAN)
+#define WATCH_MASK      (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                         IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static int render_mode(void) {
+    return (int)display_mode | (size_flag ? RENDER_SIZE : 0) | (inode_flag ? RENDER_INODE : 0)
+         | (human_flag ? RENDER_HUMAN : 0);
+}
+
+struct served_dir {
+    struct served_dir *next;        /* hash chain */
+    struct served_dir *wd_next;     /* other paths of the same watched inode */
+    char *key;                      /* absolute path */
+    int wd;
+    struct ls_dir *d;
+    struct outbuf body;             /* last rendered listing ... */
+    int body_mode, body_width;      /* ... and what it was rendered for */
+};
+
+static struct served_dir *served[SERVE_BUCKETS];
+static struct served_dir **served_by_wd;
+static int served_wd_cap;
+static int inotify_fd = -1;
+
+static size_t served_hash(const char *key) {
+    size_t h = 1469598103934665603ull;
+    for (; *key; ++key) h = (h ^ (unsigned char)*key) * 1099511628211ull;
+    return h % SERVE_BUCKETS;
+}
+
+static struct served_dir *served_lookup(const char *key) {
+    for (struct served_dir *sd = served[served_hash(key)]; sd; sd = sd->next)
+        if (strcmp(sd->key, key) == 0) return sd;
+    return NULL;
+}
+
+static void served_unlink_wd(struct served_dir *sd) {
+    if (sd->wd < 0 || sd->wd >= served_wd_cap) return;
+    for (struct served_dir **pp = &served_by_wd[sd->wd]; *pp; pp = &(*pp)->wd_next) {
+        if (*pp == sd) { *pp = sd->wd_next; break; }
+    }
+    if (!served_by_wd[sd->wd]) inotify_rm_watch(inotify_fd, sd->wd);
+}
+
+static void served_drop(struct served_dir *sd) {
+    struct served_dir **pp = &served[served_hash(sd->key)];
+    while (*pp && *pp != sd) pp = &(*pp)->next;
+    if (*pp) *pp = sd->next;
+    served_unlink_wd(sd);
+    ls_dir_free(sd->d);
+    ob_free(&sd->body);
+    free(sd->key);
+    free(sd);
+}
+
+/* drop key itself and every table below it */
+static void served_drop_tree(const char *key) {
+    size_t kl = strlen(key);
+    for (size_t b = 0; b < SERVE_BUCKETS; ++b) {
+        struct served_dir *sd = served[b];
+        while (sd) {
+            struct served_dir *next = sd->next;
+            if (strncmp(sd->key, key, kl) == 0 && (sd->key[kl] == '\0' || sd->key[kl] == '/'))
+                served_drop(sd);
+            sd = next;
+        }
+    }
+}
+
+/* takes ownership of key and d on success */
+static struct served_dir *served_store(char *key, int wd, struct ls_dir *d) {
+    struct served_dir *sd = calloc(1, sizeof(*sd));
+    if (wd >= served_wd_cap) {
+        int cap = served_wd_cap ? served_wd_cap : 256;
+        while (cap <= wd) cap *= 2;
+        struct served_dir **tmp = realloc(served_by_wd, (size_t)cap * sizeof(*tmp));
+        if (tmp) {
+            memset(tmp + served_wd_cap, 0, (size_t)(cap - served_wd_cap) * sizeof(*tmp));
+            served_by_wd = tmp;
+            served_wd_cap = cap;
+        }
+    }
+    if (!sd || wd >= served_wd_cap) {
+        free(sd);
+        return NULL;
+    }
+    sd->key = key;
+    sd->wd = wd;
+    sd->d = d;
+    sd->body.fd = -1;
+    sd->body_mode = -1;
+    size_t b = served_hash(key);
+    sd->next = served[b];
+    served[b] = sd;
+    sd->wd_next = served_by_wd[wd];
+    served_by_wd[wd] = sd;
+    return sd;
+}
+
+static void served_handle_events(void) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->wd < 0 || ev->wd >= served_wd_cap) continue;
+            if (ev->mask & IN_IGNORED) {
+                /* the kernel removed the watch: forget the wd, drop the tables */
+                while (served_by_wd[ev->wd]) {
+                    struct served_dir *sd = served_by_wd[ev->wd];
+                    served_by_wd[ev->wd] = sd->wd_next;
+                    sd->wd = -1;
+                    served_drop(sd);
+                }
+                continue;
+            }
+            /* a child directory came or went: its cached subtree is stale */
+            if ((ev->mask & IN_ISDIR) && ev->len > 0 &&
+                (ev->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE))) {
+                for (struct served_dir *sd = served_by_wd[ev->wd]; sd; sd = sd->wd_next) {
+                    char *child = ls_join_path(sd->key, ev->name);
+                    if (child) served_drop_tree(child);
+                    free(child);
+                }
+            }
+            /*
+             * Entries coming and going change the directory's mtime, size
+             * and nlink as its parent lists them. Parent keys are collected
+             * first: dropping may free tables of this wd.
+             */
+            char *parents[8];
+            int np = 0;
+            if ((ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) ||
+                ((ev->mask & IN_ATTRIB) && ev->len == 0)) {
+                for (struct served_dir *sd = served_by_wd[ev->wd]; sd && np < 8; sd = sd->wd_next) {
+                    const char *slash = strrchr(sd->key, '/');
+                    if (!slash || !slash[1]) continue;  /* "/" has no parent */
+                    char *parent = slash == sd->key ? strdup("/") : strndup(sd->key, (size_t)(slash - sd->key));
+                    if (parent) parents[np++] = parent;
+                }
+            }
+            while (served_by_wd[ev->wd]) served_drop(served_by_wd[ev->wd]);
+            for (int i = 0; i < np; ++i) {
+                struct served_dir *parent = served_lookup(parents[i]);
+                if (parent) served_drop(parent);
+                free(parents[i]);
             }
         }
     }
+}
+
+/*
+ * Absolute key for a path as the client spelled it, without "." or empty
+ * components, so one directory has one key and a key's parent is its
+ * dirname. Paths with ".." go through realpath: dropping them by hand
+ * would be wrong across symlinks.
+ */
+static char *served_key(const char *cwd, const char *path) {
+    char *key = path[0] == '/' ? strdup(path) : ls_join_path(cwd, path);
+    if (!key) return NULL;
+    for (const char *c = key; *c; c += strcspn(c, "/"), c += strspn(c, "/")) {
+        if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || !c[2])) {
+            char *real = realpath(key, NULL);
+            if (real) { free(key); return real; }
+            break;
+        }
+    }
+    size_t out = 0;
+    for (const char *c = key + strspn(key, "/"); *c; c += strspn(c, "/")) {
+        size_t len = strcspn(c, "/");
+        if (!(len == 1 && c[0] == '.')) {
+            key[out++] = '/';
+            memmove(key + out, c, len);
+            out += len;
+        }
+        c += len;
+    }
+    if (out == 0) key[out++] = '/';
+    key[out] = '\0';
+    return key;
+}
+
+/* pending directory paths of one serve_walk, popped depth-first */
+struct path_stack {
+    char **paths;
+    size_t count, cap;
+};
+
+static int path_push(struct path_stack *s, char *path) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 64;
+        char **tmp = realloc(s->paths, cap * sizeof(*tmp));
+        if (!tmp) return -1;
+        s->paths = tmp;
+        s->cap = cap;
+    }
+    s->paths[s->count++] = path;
+    return 0;
+}
+
+/* synchronous depth-first walk answered from (and filling) the table cache */
+static void serve_walk(const char *cwd, const char *root,
+                       struct outbuf *ob, int print_headers, int *first_root) {
+    struct ls_options opt = list_options();
+    struct path_stack stack = { 0 };
+    char *rp = strdup(root);
+    if (!rp || path_push(&stack, rp) != 0) { free(rp); return; }
+
+    while (stack.count > 0) {
+        char *path = stack.paths[--stack.count];
+        int is_root = path == rp;
+        char *key = served_key(cwd, path);
+        if (!key) { free(path); continue; }
+
+        struct served_dir *sd = served_lookup(key);
+        struct ls_dir *d = sd ? sd->d : NULL;
+        if (d) {
+            free(d->path);
+            d->path = path;
+            free(key);
+        } else {
+            /* watch before reading so no change slips in between */
+            int wd = inotify_add_watch(inotify_fd, key, WATCH_MASK | IN_ONLYDIR);
+            d = ls_read_dir(path, &opt);
+            free(path);
+            if (d && d->err == 0 && wd >= 0 && (sd = served_store(key, wd, d)) != NULL)
+                key = NULL;
+            if (!sd && wd >= 0 && (wd >= served_wd_cap || !served_by_wd[wd]))
+                inotify_rm_watch(inotify_fd, wd);
+            free(key);
+            if (!d) continue;
+        }
+
+        d->is_root = is_root;
+        if (!sd) {
+            render_dir(ob, d, print_headers, first_root);
+        } else {
+            /* cached tables also keep their rendered bytes for repeat requests */
+            render_header(ob, d, print_headers, first_root);
+            int mode = render_mode();
+            if (sd->body_mode != mode || sd->body_width != term_width) {
+                int clean = 1;
+                for (size_t i = 0; i < d->count; ++i) if (d->ents[i].stat_err) clean = 0;
+                sd->body.len = 0;
+                render_body(&sd->body, d);
+                sd->body_mode = clean ? mode : -1;
+                sd->body_width = term_width;
+            }
+            if (sd->body.len) ob_write(ob, sd->body.buf, sd->body.len);
+        }
+
+        /* entries are sorted, so children come out in walk order */
+        for (size_t i = d->count; recursive_flag && i-- > 0;) {
+            const struct ls_entry *e = &d->ents[i];
+            if (e->stat_err || !S_ISDIR(e->st.st_mode)) continue;
+            char *child = ls_join_path(d->path, e->name);
+            if (child && path_push(&stack, child) != 0) free(child);
+        }
+        if (!sd) ls_dir_free(d);
+    }
+    for (size_t i = 0; i < stack.count; ++i) free(stack.paths[i]);
+    free(stack.paths);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == 0) return -1;
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void send_frame(int fd, char tag, const struct outbuf *ob) {
+    if (ob->len == 0) return;
+    unsigned char hdr[5] = { (unsigned char)tag,
+        (unsigned char)(ob->len >> 24), (unsigned char)(ob->len >> 16),
+        (unsigned char)(ob->len >> 8), (unsigned char)ob->len };
+    if (write_all(fd, hdr, sizeof(hdr)) == 0) write_all(fd, ob->buf, ob->len);
+}
 
-    for (size_t i = 0; i < count; ++i) free(files[i]);
-    free(files);
+static void refuse_client(int cfd, const char *why) {
+    struct outbuf msg = { -1, NULL, 0, 0, 0 };
+    ob_printf(&msg, "ls: --serve: %s\n", why);
+    send_frame(cfd, 'x', &msg);
+    ob_free(&msg);
 }
 
-/* ---------- Long listing (-l) ---------- */
-void do_ls_long(const char *dir) {
-    DIR *dp = opendir(dir);
-    if (!dp) { perror(dir); return; }
+static void serve_client(int cfd) {
+    /* an idle or stalled client must not hold up the others or the inotify queue */
+    struct timeval tv = { SERVE_TIMEOUT_MS / 1000, (SERVE_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    unsigned char hdr[4];
+    if (read_all(cfd, hdr, sizeof(hdr)) != 0) return;
+    size_t len = ((size_t)hdr[0] << 24) | ((size_t)hdr[1] << 16) | ((size_t)hdr[2] << 8) | hdr[3];
+    if (len > SERVE_MAX_REQUEST) { refuse_client(cfd, "request too large"); return; }
+    struct outbuf req = { -1, NULL, 0, 0, 0 };
+    if (ob_grow(&req, len + 1) != 0 || read_all(cfd, req.buf, len) != 0) { ob_free(&req); return; }
+    req.buf[len] = '\0';
+    req.len = len + 1;
+
+    /* split the NUL-separated fields */
+    size_t maxf = 1;
+    for (size_t off = 0; off < len; ++off) maxf += req.buf[off] == '\0';
+    char **fields = malloc(maxf * sizeof(*fields));
+    int nf = 0;
+    for (size_t off = 0; fields && off < len;) {
+        fields[nf++] = req.buf + off;
+        off += strlen(req.buf + off) + 1;
+    }
+    if (!fields || nf < 5 || strcmp(fields[0], "LSQ2") != 0) {
+        refuse_client(cfd, fields ? "malformed request" : strerror(ENOMEM));
+        free(fields);
+        ob_free(&req);
+        return;
+    }
 
-    struct dirent *entry;
-    char **files = NULL;
-    size_t count = 0;
+    struct outbuf resp = { -1, NULL, 0, 0, 0 }, errs = { -1, NULL, 0, 0, 0 };
+    enum DisplayMode saved_mode = display_mode;
+    int saved_rec = recursive_flag, saved_width = term_width;
+    int saved_size = size_flag, saved_inode = inode_flag, saved_human = human_flag;
+    int mode = atoi(fields[1]);
+    display_mode = (enum DisplayMode)(mode & ~RENDER_FLAGS);
+    size_flag = (mode & RENDER_SIZE) != 0;
+    inode_flag = (mode & RENDER_INODE) != 0;
+    human_flag = (mode & RENDER_HUMAN) != 0;
+    recursive_flag = atoi(fields[2]);
+    term_width = atoi(fields[3]) > 0 ? atoi(fields[3]) : 80;
+    const char *cwd = fields[4];
+    err_sink = &errs;
 
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_name[0] == '.') continue;
-        char *dup = strdup(entry->d_name);
-        if (!dup) continue;
-        char **tmp = realloc(files, (count + 1) * sizeof(char*));
-        if (!tmp) { free(dup); break; }
-        files = tmp;
-        files[count++] = dup;
+    int first_root = 1;
+    if (chdir(cwd) == -1) {
+        report_error(cwd, errno);
+    } else if (nf == 5) {
+        serve_walk(cwd, ".", &resp, 0, &first_root);
+    } else {
+        for (int i = 5; i < nf; ++i) serve_walk(cwd, fields[i], &resp, 1, &first_root);
     }
-    closedir(dp);
 
-    if (count == 0) { free(files); return; }
+    err_sink = NULL;
+    display_mode = saved_mode;
+    recursive_flag = saved_rec;
+    term_width = saved_width;
+    size_flag = saved_size;
+    inode_flag = saved_inode;
+    human_flag = saved_human;
 
-    qsort(files, count, sizeof(char*), compare_names);
+    send_frame(cfd, 'o', &resp);
+    send_frame(cfd, 'e', &errs);
+    ob_free(&resp);
+    ob_free(&errs);
+    free(fields);
+    ob_free(&req);
+}
+
+static int unix_socket(const char *path, struct sockaddr_un *addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) perror("socket");
+    return fd;
+}
 
-    for (size_t i = 0; i < count; ++i) {
-        char path[PATH_MAX];
-        if (snprintf(path, sizeof(path), "%s/%s", dir, files[i]) < 0) continue;
-        print_file_details(path, files[i]);
+static int run_server(const char *sock_path) {
+    struct sockaddr_un addr;
+    int lfd = unix_socket(sock_path, &addr);
+    if (lfd < 0) return EXIT_FAILURE;
+    unlink(sock_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(lfd, 64) == -1) {
+        perror(sock_path);
+        return EXIT_FAILURE;
     }
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) { perror("inotify_init1"); return EXIT_FAILURE; }
+    signal(SIGPIPE, SIG_IGN);
 
-    /* recursion after long listing */
-    if (recursive_flag) {
-        for (size_t i = 0; i < count; ++i) {
-            char path[PATH_MAX];
-            if (snprintf(path, sizeof(path), "%s/%s", dir, files[i]) < 0) continue;
-            struct stat st;
-            if (lstat(path, &st) == -1) continue;
-            if (S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)) {
-                if (strcmp(files[i], ".") == 0 || strcmp(files[i], "..") == 0) continue;
-                putchar('\n');
-                printf("%s:\n", path);
-                do_ls(path);
+    for (;;) {
+        struct pollfd pfd[2] = { { inotify_fd, POLLIN, 0 }, { lfd, POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return EXIT_FAILURE;
+        }
+        /* apply pending changes before answering anything */
+        if (pfd[0].revents & POLLIN) served_handle_events();
+        if (pfd[1].revents & POLLIN) {
+            int cfd = accept(lfd, NULL, NULL);
+            if (cfd < 0) continue;
+            served_handle_events();
+            serve_client(cfd);
+            close(cfd);
+        }
+    }
+}
+
+static int run_client(const char *sock_path, char **args, int nargs) {
+    struct sockaddr_un addr;
+    int fd = unix_socket(sock_path, &addr);
+    if (fd < 0) return EXIT_FAILURE;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(sock_path);
+        return EXIT_FAILURE;
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) { perror("getcwd"); return EXIT_FAILURE; }
+    struct outbuf req = { -1, NULL, 0, 0, 0 };
+    ob_write(&req, "\0\0\0\0", 4);      /* length, filled in below */
+    ob_printf(&req, "LSQ2%c%d%c%d%c%d%c", 0, render_mode(), 0, recursive_flag, 0, term_width, 0);
+    ob_write(&req, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < nargs; ++i) ob_write(&req, args[i], strlen(args[i]) + 1);
+    free(cwd);
+    size_t len = req.len - 4;
+    if (len > SERVE_MAX_REQUEST) {
+        fprintf(stderr, "%s: too many arguments for --client\n", sock_path);
+        ob_free(&req);
+        return EXIT_FAILURE;
+    }
+    req.buf[0] = (char)(len >> 24);
+    req.buf[1] = (char)(len >> 16);
+    req.buf[2] = (char)(len >> 8);
+    req.buf[3] = (char)len;
+    int rc = write_all(fd, req.buf, req.len);
+    ob_free(&req);
+    if (rc != 0) { perror("write"); return EXIT_FAILURE; }
+
+    unsigned char hdr[5];
+    char buf[64 * 1024];
+    int status = 0;
+    while (read_all(fd, hdr, sizeof(hdr)) == 0) {
+        size_t len = ((size_t)hdr[1] << 24) | ((size_t)hdr[2] << 16) | ((size_t)hdr[3] << 8) | hdr[4];
+        if (hdr[0] == 'x') status = EXIT_FAILURE;
+        int dest = hdr[0] == 'o' ? STDOUT_FILENO : STDERR_FILENO;
+        while (len > 0) {
+            size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+            if (read_all(fd, buf, chunk) != 0) { close(fd); return EXIT_FAILURE; }
+            write_all(dest, buf, chunk);
+            len -= chunk;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+/* ---------- watch mode (-w) ---------- */
+
+/*
+ * -w lists a directory once and then follows it with inotify. The entry
+ * table is kept in an AVL tree ordered like the listing, so creates,
+ * deletes and renames cost O(log n), and only the entries that actually
+ * changed are printed again:
+ *   + line   new entry        - name   removed entry        ~ line   changed
+ * Events are coalesced for WATCH_SETTLE_MS and each name is re-stat'ed
+ * once, so a busy directory costs one lstat per changed name per window.
+ */
+#define WATCH_SETTLE_MS 50
+
+struct watch_node {
+    struct watch_node *left, *right;
+    int height;
+    struct ls_entry e;
+    char name[];
+};
+
+static int wn_height(const struct watch_node *n) { return n ? n->height : 0; }
+
+static void wn_fix(struct watch_node *n) {
+    int hl = wn_height(n->left), hr = wn_height(n->right);
+    n->height = (hl > hr ? hl : hr) + 1;
+}
+
+static struct watch_node *wn_rotate_right(struct watch_node *n) {
+    struct watch_node *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    wn_fix(n);
+    wn_fix(l);
+    return l;
+}
+
+static struct watch_node *wn_rotate_left(struct watch_node *n) {
+    struct watch_node *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    wn_fix(n);
+    wn_fix(r);
+    return r;
+}
+
+static struct watch_node *wn_balance(struct watch_node *n) {
+    wn_fix(n);
+    int bal = wn_height(n->left) - wn_height(n->right);
+    if (bal > 1) {
+        if (wn_height(n->left->left) < wn_height(n->left->right)) n->left = wn_rotate_left(n->left);
+        return wn_rotate_right(n);
+    }
+    if (bal < -1) {
+        if (wn_height(n->right->right) < wn_height(n->right->left)) n->right = wn_rotate_right(n->right);
+        return wn_rotate_left(n);
+    }
+    return n;
+}
+
+static struct watch_node *wn_new(const struct ls_entry *e) {
+    struct watch_node *n = malloc(sizeof(*n) + e->name_len + 1);
+    if (!n) return NULL;
+    n->left = n->right = NULL;
+    n->height = 1;
+    n->e = *e;
+    memcpy(n->name, e->name, e->name_len + 1);
+    n->e.name = n->name;
+    return n;
+}
+
+/* insert e (must not be present) */
+static struct watch_node *wn_insert(struct watch_node *n, struct watch_node *add) {
+    if (!n) return add;
+    if (ls_compare_names(add->name, n->name, collate_flag) < 0) n->left = wn_insert(n->left, add);
+    else n->right = wn_insert(n->right, add);
+    return wn_balance(n);
+}
+
+static struct watch_node *wn_pop_min(struct watch_node *n, struct watch_node **min) {
+    if (!n->left) { *min = n; return n->right; }
+    n->left = wn_pop_min(n->left, min);
+    return wn_balance(n);
+}
+
+/* unlink and free the node called name, if any */
+static struct watch_node *wn_remove(struct watch_node *n, const char *name) {
+    if (!n) return NULL;
+    int c = ls_compare_names(name, n->name, collate_flag);
+    if (c < 0) { n->left = wn_remove(n->left, name); return wn_balance(n); }
+    if (c > 0) { n->right = wn_remove(n->right, name); return wn_balance(n); }
+    struct watch_node *l = n->left, *r = n->right;
+    free(n);
+    if (!r) return l;
+    struct watch_node *min;
+    r = wn_pop_min(r, &min);
+    min->left = l;
+    min->right = r;
+    return wn_balance(min);
+}
+
+static struct watch_node *wn_find(struct watch_node *n, const char *name) {
+    while (n) {
+        int c = ls_compare_names(name, n->name, collate_flag);
+        if (c == 0) return n;
+        n = c < 0 ? n->left : n->right;
+    }
+    return NULL;
+}
+
+/* balanced tree straight from the sorted table */
+static struct watch_node *wn_build(const struct ls_entry *ents, size_t lo, size_t hi) {
+    if (lo >= hi) return NULL;
+    size_t mid = lo + (hi - lo) / 2;
+    struct watch_node *n = wn_new(&ents[mid]);
+    if (!n) return NULL;
+    n->left = wn_build(ents, lo, mid);
+    n->right = wn_build(ents, mid + 1, hi);
+    wn_fix(n);
+    return n;
+}
+
+static void wn_free(struct watch_node *n) {
+    if (!n) return;
+    wn_free(n->left);
+    wn_free(n->right);
+    free(n);
+}
+
+static void watch_print(struct outbuf *ob, char tag, const struct ls_entry *e) {
+    ob_putc(ob, tag);
+    ob_putc(ob, ' ');
+    if (tag == '-') {
+        ob_write(ob, e->name, e->name_len);
+        ob_putc(ob, '\n');
+    } else if (display_mode == LONG_LIST) {
+        print_file_details(ob, e);
+    } else {
+        print_colored_name_no_pad(ob, e);
+        ob_putc(ob, '\n');
+    }
+}
+
+static int same_metadata(const struct stat *a, const struct stat *b) {
+    return a->st_mode == b->st_mode && a->st_nlink == b->st_nlink &&
+           a->st_uid == b->st_uid && a->st_gid == b->st_gid &&
+           a->st_size == b->st_size && a->st_ino == b->st_ino &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* bring one name in line with the filesystem, printing what changed */
+static struct watch_node *watch_reconcile(struct watch_node *root, int dfd, const char *name) {
+    struct ls_entry e;
+    memset(&e, 0, sizeof(e));
+    e.name = name;
+    e.name_len = strlen(name);
+    struct watch_node *n = wn_find(root, name);
+
+    /* an entry that stops passing the filters leaves the listing like a removed one */
+    if (fstatat(dfd, name, &e.st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        (filter.count && !ls_filter_match(&filter, &e))) {
+        if (n) {
+            watch_print(&out, '-', &n->e);
+            root = wn_remove(root, name);
+        }
+        return root;
+    }
+    e.ino = e.st.st_ino;
+    if (n) {
+        if (!same_metadata(&n->e.st, &e.st)) {
+            n->e.st = e.st;
+            n->e.ino = e.ino;
+            watch_print(&out, '~', &n->e);
+        }
+        return root;
+    }
+    struct watch_node *add = wn_new(&e);
+    if (!add) return root;
+    watch_print(&out, '+', &add->e);
+    return wn_insert(root, add);
+}
+
+static int cmp_cstr(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int run_watch(const char *dir) {
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0) { perror("inotify_init1"); return EXIT_FAILURE; }
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+                    IN_CLOSE_WRITE | IN_MODIFY | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+    /* subscribe first so nothing between the listing and the watch is lost */
+    if (inotify_add_watch(ifd, dir, mask) < 0) { perror(dir); return EXIT_FAILURE; }
+
+    struct watch_node *root = NULL;
+    int relist = 1;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char **names = NULL;
+    size_t nnames = 0, cap = 0;
+
+    for (;;) {
+        if (relist) {
+            /* first pass, or the kernel queue overflowed: start from scratch */
+            struct ls_options opt = list_options();
+            struct ls_dir *d = ls_read_dir(dir, &opt);
+            if (d) {
+                int first = 1;
+                render_dir(&out, d, 1, &first);
+                wn_free(root);
+                root = d->err == 0 ? wn_build(d->ents, 0, d->count) : NULL;
+            }
+            ls_dir_free(d);
+            ob_flush(&out);
+            relist = 0;
+        }
+
+        ssize_t n = read(ifd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("inotify");
+            break;
+        }
+        /* let a burst settle, then take everything that arrived */
+        struct pollfd pfd = { ifd, POLLIN, 0 };
+        size_t len = (size_t)n;
+        while (len < sizeof(buf) / 2 && poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+            ssize_t m = read(ifd, buf + len, sizeof(buf) - len);
+            if (m <= 0) break;
+            len += (size_t)m;
+        }
+
+        int gone = 0;
+        nnames = 0;
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) relist = 1;
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) gone = 1;
+            if (ev->len == 0 || ev->name[0] == '.') continue;
+            if (nnames == cap) {
+                cap = cap ? cap * 2 : 64;
+                char **tmp = realloc(names, cap * sizeof(char *));
+                if (!tmp) break;
+                names = tmp;
             }
+            char *copy = strdup(ev->name);
+            if (copy) names[nnames++] = copy;
+        }
+
+        /* each name once per window, in listing order; the directory is
+         * opened per window only, so holding it never delays IN_DELETE_SELF */
+        qsort(names, nnames, sizeof(char *), cmp_cstr);
+        int dfd = nnames && !relist ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        for (size_t i = 0; dfd >= 0 && i < nnames; ++i) {
+            if (i == 0 || strcmp(names[i], names[i - 1]) != 0)
+                root = watch_reconcile(root, dfd, names[i]);
+        }
+        if (dfd >= 0) close(dfd);
+        for (size_t i = 0; i < nnames; ++i) free(names[i]);
+        ob_flush(&out);
+
+        if (gone) {
+            report_error(dir, ENOENT);
+            break;
         }
     }
+    free(names);
+    wn_free(root);
+    close(ifd);
+    return EXIT_FAILURE;
+}
+
+/* ---------- filter options ---------- */
 
-    for (size_t i = 0; i < count; ++i) free(files[i]);
-    free(files);
+/* --type letter, as in find(1) */
+static int parse_type(const char *s, mode_t *type) {
+    static const char letters[] = "fdlbcps";
+    static const mode_t types[] = { S_IFREG, S_IFDIR, S_IFLNK, S_IFBLK, S_IFCHR, S_IFIFO, S_IFSOCK };
+    const char *c = s[0] && !s[1] ? strchr(letters, s[0]) : NULL;
+    if (!c) return -1;
+    *type = types[c - letters];
+    return 0;
 }
 
-/* ---------- print metadata for -l ---------- */
-void print_file_details(const char *path, const char *filename) {
+/* --size [+-]N[kMG]: more than, less than or exactly N bytes (k = 1024) */
+static int parse_size(const char *s, struct ls_pred *p) {
+    p->cmp = *s == '+' ? 1 : *s == '-' ? -1 : 0;
+    if (p->cmp) s++;
+    if (*s < '0' || *s > '9') return -1;
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+    }
+    if (*end || errno || n > ((unsigned long long)INT64_MAX >> shift)) return -1;
+    p->size = (off_t)(n << shift);
+    return 0;
+}
+
+/* --newer: a reference file's mtime, @SECONDS, or YYYY-MM-DD[ HH:MM[:SS]] in local time */
+static int parse_time(const char *s, struct timespec *ts) {
     struct stat st;
-    if (lstat(path, &st) == -1) {
-        perror("stat");
-        return;
+    if (stat(s, &st) == 0) { *ts = st.st_mtim; return 0; }
+    char *end;
+    if (*s == '@') {
+        errno = 0;
+        long long secs = strtoll(s + 1, &end, 10);
+        if (end == s + 1 || *end || errno) return -1;
+        ts->tv_sec = (time_t)secs;
+        ts->tv_nsec = 0;
+        return 0;
+    }
+    struct tm tm = { 0 };
+    int n = 0;
+    if (sscanf(s, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) != 3) return -1;
+    s += n;
+    if (*s == ' ' || *s == 'T') {
+        if (sscanf(s + 1, "%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &n) != 2) return -1;
+        s += 1 + n;
+        if (*s == ':') {
+            if (sscanf(s + 1, "%2d%n", &tm.tm_sec, &n) != 1) return -1;
+            s += 1 + n;
+        }
     }
+    if (*s) return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    if (t == (time_t)-1) return -1;
+    ts->tv_sec = t;
+    ts->tv_nsec = 0;
+    return 0;
+}
+
+/* ---------- main ---------- */
+enum { OPT_STATS = 256, OPT_CACHE, OPT_SERVE, OPT_CLIENT, OPT_SAVE_SNAPSHOT, OPT_DIFF, OPT_FORMAT, OPT_TOTAL, OPT_TOP, OPT_BY,
+       OPT_NAME, OPT_TYPE, OPT_SIZE, OPT_NEWER, OPT_GITIGNORE,
+       OPT_MAX_DEPTH, OPT_ONE_FS, OPT_STAT_ORDER, OPT_DIR_TIMEOUT,
+       OPT_MAX_IOPS, OPT_MAX_DIRS, OPT_IDLE_IO, OPT_CHECKPOINT, OPT_RESUME,
+       OPT_COUNT, OPT_ESTIMATE };
+
+static const struct option long_options[] = {
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "cache", required_argument, NULL, OPT_CACHE },
+    { "serve", required_argument, NULL, OPT_SERVE },
+    { "client", required_argument, NULL, OPT_CLIENT },
+    { "save-snapshot", required_argument, NULL, OPT_SAVE_SNAPSHOT },
+    { "diff", required_argument, NULL, OPT_DIFF },
+    { "format", required_argument, NULL, OPT_FORMAT },
+    { "total", no_argument, NULL, OPT_TOTAL },
+    { "top", required_argument, NULL, OPT_TOP },
+    { "by", required_argument, NULL, OPT_BY },
+    { "name", required_argument, NULL, OPT_NAME },
+    { "type", required_argument, NULL, OPT_TYPE },
+    { "size", required_argument, NULL, OPT_SIZE },
+    { "newer", required_argument, NULL, OPT_NEWER },
+    { "hide", required_argument, NULL, 'I' },
+    { "gitignore", no_argument, NULL, OPT_GITIGNORE },
+    { "max-depth", required_argument, NULL, OPT_MAX_DEPTH },
+    { "one-file-system", no_argument, NULL, OPT_ONE_FS },
+    { "stat-order", required_argument, NULL, OPT_STAT_ORDER },
+    { "dir-timeout", required_argument, NULL, OPT_DIR_TIMEOUT },
+    { "max-iops", required_argument, NULL, OPT_MAX_IOPS },
+    { "max-dirs-per-sec", required_argument, NULL, OPT_MAX_DIRS },
+    { "idle-io", no_argument, NULL, OPT_IDLE_IO },
+    { "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+    { "resume", required_argument, NULL, OPT_RESUME },
+    { "count", optional_argument, NULL, OPT_COUNT },
+    { "estimate", optional_argument, NULL, OPT_ESTIMATE },
+    { NULL, 0, NULL, 0 }
+};
+
+/* --max-iops, --max-dirs-per-sec: a positive rate */
+static unsigned parse_rate(const char *prog, const char *name, const char *arg) {
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+    if (*end || n < 1 || n > 1000000000) {
+        fprintf(stderr, "%s: invalid --%s '%s'\n", prog, name, arg);
+        exit(EXIT_FAILURE);
+    }
+    return (unsigned)n;
+}
 
-    print_permissions(st.st_mode);
-    printf(" %2ld", (long)st.st_nlink);
+/*
+ * --idle-io: the idle I/O class, so the disk serves the listing only when
+ * nobody else wants it (honoured by the BFQ and CFQ schedulers). Set before
+ * any thread starts; threads inherit it.
+ */
+#define IOPRIO_WHO_PROCESS      1
+#define IOPRIO_CLASS_IDLE       3
+#define IOPRIO_CLASS_SHIFT      13
+
+static void set_idle_io(const char *prog) {
+#ifdef SYS_ioprio_set
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+        fprintf(stderr, "%s: ioprio_set: %s\n", prog, strerror(errno));
+#else
+    fprintf(stderr, "%s: --idle-io is not supported on this system\n", prog);
+#endif
+}
+
+static void print_stats(void) {
+    fprintf(stderr, "fd budget %d per walker: %lu dir opens (%lu dirfd-relative), "
+            "%lu evictions, %lu reopens\n", walk_totals.fd_budget, walk_totals.opens,
+            walk_totals.relative, walk_totals.evictions, walk_totals.reopens);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int stats_flag = 0;
+    int idle_io = 0;
+    const char *resume_file = NULL;
+    const char *serve_sock = NULL, *client_sock = NULL;
+    const char *save_path = NULL, *diff_path = NULL;
 
-    struct passwd *pw = getpwuid(st.st_uid);
-    struct group *gr = getgrgid(st.st_gid);
-    printf(" %-8s %-8s", pw ? pw->pw_name : "unknown", gr ? gr->gr_name : "unknown");
+    int watch_flag = 0;
+    int max_depth_zero = 0;
 
-    printf(" %8ld", (long)st.st_size);
+    while ((opt = getopt_long(argc, argv, "lxRwsihLI:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'l': display_mode = LONG_LIST; break;
+            case 'x': display_mode = HORIZONTAL; break;
+            case 'R': recursive_flag = 1; break;
+            case 'w': watch_flag = 1; break;
+            case 's': size_flag = 1; break;
+            case 'i': inode_flag = 1; break;
+            case 'h': human_flag = 1; break;
+            case 'L': follow_flag = 1; break;
+            case 'I': {
+                const char **tmp = realloc(hide_pats, (nhide + 1) * sizeof(*tmp));
+                if (!tmp) { perror("realloc"); exit(EXIT_FAILURE); }
+                hide_pats = tmp;
+                hide_pats[nhide++] = optarg;
+                break;
+            }
+            case OPT_GITIGNORE: gitignore_flag = 1; break;
+            case OPT_MAX_DEPTH: {
+                char *end;
+                long long n = strtoll(optarg, &end, 10);
+                if (end == optarg || *end || n < 0) {
+                    fprintf(stderr, "%s: invalid --max-depth '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                max_depth = (size_t)n;
+                max_depth_zero = n == 0;
+                break;
+            }
+            case OPT_ONE_FS: one_fs_flag = 1; break;
+            case OPT_STAT_ORDER:
+                if (strcmp(optarg, "ino") == 0) stat_order = LS_STAT_INO;
+                else if (strcmp(optarg, "readdir") == 0) stat_order = LS_STAT_READDIR;
+                else { fprintf(stderr, "%s: --stat-order must be ino or readdir\n", argv[0]); exit(EXIT_FAILURE); }
+                break;
+            case OPT_MAX_IOPS: max_iops = parse_rate(argv[0], "max-iops", optarg); break;
+            case OPT_MAX_DIRS: max_dirs_per_sec = parse_rate(argv[0], "max-dirs-per-sec", optarg); break;
+            case OPT_IDLE_IO: idle_io = 1; break;
+            case OPT_CHECKPOINT: checkpoint_path = optarg; break;
+            case OPT_RESUME: resume_file = optarg; break;
+            case OPT_COUNT:
+                if (optarg && strcmp(optarg, "types") != 0) {
+                    fprintf(stderr, "%s: --count takes no argument but 'types'\n", argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                if (count_mode != LS_COUNT_ESTIMATE) count_mode = LS_COUNT_EXACT;
+                count_types = optarg != NULL;
+                break;
+            case OPT_ESTIMATE:
+                count_mode = LS_COUNT_ESTIMATE;
+                if (optarg) {
+                    /* getdents buffers sampled per directory */
+                    char *end;
+                    long long n = strtoll(optarg, &end, 10);
+                    if (*end || n < 1 || n > 1000000) {
+                        fprintf(stderr, "%s: invalid --estimate '%s'\n", argv[0], optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    sample_buffers = (size_t)n;
+                }
+                break;
+            case OPT_DIR_TIMEOUT: {
+                /* seconds, fractions allowed */
+                char *end;
+                double secs = strtod(optarg, &end);
+                if (*end || !(secs >= 0.001 && secs <= 86400)) {
+                    fprintf(stderr, "%s: invalid --dir-timeout '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                dir_timeout = (unsigned)(secs * 1000 + 0.5);
+                break;
+            }
+            case OPT_TOTAL: tree_totals = size_flag = 1; break;
+            case OPT_TOP: {
+                char *end;
+                long long k = strtoll(optarg, &end, 10);
+                if (*end || k < 1) { fprintf(stderr, "%s: invalid --top count '%s'\n", argv[0], optarg); exit(EXIT_FAILURE); }
+                top_k = (size_t)k;
+                break;
+            }
+            case OPT_BY:
+                if (strcmp(optarg, "size") == 0) top_by = LS_TOP_SIZE;
+                else if (strcmp(optarg, "mtime") == 0) top_by = LS_TOP_MTIME;
+                else { fprintf(stderr, "%s: --by must be size or mtime\n", argv[0]); exit(EXIT_FAILURE); }
+                break;
+            case OPT_NAME: case OPT_TYPE: case OPT_SIZE: case OPT_NEWER: {
+                struct ls_pred p = { 0 };
+                int rc = 0;
+                const char *flag = "name";
+                if (opt == OPT_NAME) { p.test = LS_TEST_NAME; p.glob = optarg; }
+                else if (opt == OPT_TYPE) { p.test = LS_TEST_TYPE; rc = parse_type(optarg, &p.type); flag = "type"; }
+                else if (opt == OPT_SIZE) { p.test = LS_TEST_SIZE; rc = parse_size(optarg, &p); flag = "size"; }
+                else { p.test = LS_TEST_NEWER; rc = parse_time(optarg, &p.time); flag = "newer"; }
+                if (rc != 0) {
+                    fprintf(stderr, "%s: invalid argument '%s' for --%s\n", argv[0], optarg, flag);
+                    exit(EXIT_FAILURE);
+                }
+                if (ls_filter_add(&filter, &p) != 0) { perror("ls_filter_add"); exit(EXIT_FAILURE); }
+                break;
+            }
+            case OPT_STATS: stats_flag = 1; break;
+            case OPT_CACHE: cache_dir = optarg; break;
+            case OPT_SERVE: serve_sock = optarg; break;
+            case OPT_CLIENT: client_sock = optarg; break;
+            case OPT_SAVE_SNAPSHOT: save_path = optarg; break;
+            case OPT_DIFF: diff_path = optarg; break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "ndjson") == 0) output_format = FMT_NDJSON;
+                else if (strcmp(optarg, "bin") == 0) output_format = FMT_BIN;
+                else if (strcmp(optarg, "text") == 0) output_format = FMT_TEXT;
+                else { fprintf(stderr, "%s: unknown format '%s'\n", argv[0], optarg); exit(EXIT_FAILURE); }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-l] [-x] [-R] [-L] [-w] [-s] [-i] [-h] [-I PATTERN] [--gitignore] [--max-depth N] [--one-file-system] [--total] [--top=K [--by=size|mtime]]"
+                                "\n       [--name GLOB] [--type f|d|l|b|c|p|s] [--size [+-]N[kMG]] [--newer FILE|@SECS|DATE] [--cache=DIR] [--stat-order=ino|readdir] [--dir-timeout=SECS] [--max-iops=N] [--max-dirs-per-sec=N] [--idle-io] [--checkpoint FILE] [--resume FILE]"
+                                "\n       [--count[=types]] [--estimate[=N]] [--stats] [--serve SOCKET | --client SOCKET]"
+                                "\n       [--save-snapshot FILE | --diff FILE] [--format=text|ndjson|bin] [directory...]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (tree_totals && (serve_sock || client_sock || watch_flag || save_path || diff_path)) {
+        /* those walk in pre-order or one directory at a time */
+        fprintf(stderr, "%s: --total cannot be combined with --serve, --client, -w or snapshots\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if ((serve_sock || client_sock) && (follow_flag || nhide || gitignore_flag || max_depth || max_depth_zero ||
+                                        one_fs_flag)) {
+        /* the daemon's walk and cache do not honour them */
+        fprintf(stderr, "%s: -L, -I, --gitignore, --max-depth and --one-file-system cannot be combined "
+                "with --serve or --client\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (watch_flag && (follow_flag || recursive_flag || output_format != FMT_TEXT || save_path || diff_path ||
+                       argc - optind > 1)) {
+        /* it follows one directory, by lstat, as text */
+        fprintf(stderr, "%s: -w takes one directory and cannot be combined with -L, -R, --format or snapshots\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (watch_flag && (nhide || gitignore_flag)) {
+        /* -w re-stats each changed name on its own, without the ignore rules */
+        fprintf(stderr, "%s: -I and --gitignore cannot be combined with -w\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if ((serve_sock || client_sock) && output_format != FMT_TEXT) {
+        /* the daemon renders text only */
+        fprintf(stderr, "%s: --format cannot be combined with --serve or --client\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (filter.count && (tree_totals || serve_sock || client_sock)) {
+        /* totals would silently leave out the filtered entries */
+        fprintf(stderr, "%s: filters cannot be combined with --total, --serve or --client\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (top_k && (tree_totals || serve_sock || client_sock || watch_flag || save_path || diff_path ||
+                  output_format != FMT_TEXT)) {
+        fprintf(stderr, "%s: --top only combines with listing options\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if ((checkpoint_path || resume_file) &&
+        (tree_totals || top_k || serve_sock || client_sock || watch_flag || save_path || diff_path ||
+         output_format == FMT_BIN)) {
+        /* those either do not list in walk order or do not write a plain stream */
+        fprintf(stderr, "%s: --checkpoint and --resume only combine with listing options\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (count_mode && (filter.count || tree_totals || top_k || serve_sock || client_sock || watch_flag ||
+                       save_path || diff_path || output_format != FMT_TEXT || checkpoint_path || resume_file)) {
+        /* counts come from getdents alone: nothing to filter, total or render */
+        fprintf(stderr, "%s: --count and --estimate only combine with walk options\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    /* --max-depth 0: the roots only */
+    if (max_depth_zero) recursive_flag = 0;
+    if (idle_io) set_idle_io(argv[0]);
+    if (cache_dir && mkdir(cache_dir, 0700) == -1 && errno != EEXIST) {
+        perror(cache_dir);
+        cache_dir = NULL;
+    }
+
+    /* C.UTF-8 collates by code point, which is byte order for UTF-8 */
+    const char *coll = setlocale(LC_COLLATE, "");
+    collate_flag = coll && strcmp(coll, "C") != 0 && strcmp(coll, "POSIX") != 0 && strncmp(coll, "C.", 2) != 0;
+
+    term_width = get_terminal_width();
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    par_threads = ncpu < 1 ? 1 : ncpu > LS_MAX_THREADS ? LS_MAX_THREADS : (int)ncpu;
+    ob_init(&out, STDOUT_FILENO);
+    int nroots = argc - optind;
+    if (checkpoint_path || resume_file) {
+        char *dot[1] = { "." };
+        args_hash = nroots ? hash_args(argv + optind, nroots) : hash_args(dot, 1);
+    }
+    if (resume_file) {
+        resume_load(argv[0], resume_file);
+        if (!checkpoint_path) checkpoint_path = resume_file;
+    }
+
+    if (serve_sock) return run_server(serve_sock);
+    if (client_sock) return run_client(client_sock, argv + optind, nroots);
+    if (watch_flag) return run_watch(nroots > 0 ? argv[optind] : ".");
+    if (save_path && snap_open_output(save_path) != 0) return EXIT_FAILURE;
+    if (diff_path && snap_open_input(diff_path) != 0) return EXIT_FAILURE;
+    if (output_format == FMT_BIN && !snap_out && !snap_in) {
+        if (isatty(STDOUT_FILENO)) {
+            fprintf(stderr, "%s: refusing to write binary output to a terminal\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        struct lsbin_header h = { LSBIN_MAGIC, LSBIN_VERSION };
+        ob_write(&out, (const char *)&h, sizeof(h));
+    }
+
+    if (top_k) {
+        char *dot[1] = { "." };
+        if (optind == argc) run_top(dot, 1);
+        else run_top(argv + optind, argc - optind);
+    } else if (count_mode) {
+        char *dot[1] = { "." };
+        if (optind == argc) run_count(dot, 1);
+        else run_count(argv + optind, argc - optind);
+    } else if (optind == argc) {
+        char *dot[1] = { "." };
+        run_listing(dot, 1, 0);
+    } else if (argc - optind == 1) {
+        run_listing(argv + optind, 1, 1);
+    } else {
+        run_listing(argv + optind, argc - optind, 1);
+    }
+
+    if (snap_in) {
+        diff_drain_until(0, NULL);
+        ob_flush(&out);
+    }
+    if (snap_out && fclose(snap_out) != 0) perror(save_path);
+
+    if (stats_flag) print_stats();
+    if (cache_dir)
+        fprintf(stderr, "cache: %lu hits, %lu misses\n",
+                walk_totals.cache_hits, walk_totals.cache_misses);
+    if (walk_totals.timeouts)
+        fprintf(stderr, "%s: %lu directories timed out; their reads were abandoned\n", argv[0],
+                walk_totals.timeouts);
+    return 0;
+}
+
+/* ---------- print metadata for -l ---------- */
+
+/* "%b %d %H:%M"; localtime and strftime only run when the minute changes */
+static size_t fmt_mtime(char *buf, time_t t) {
+    static _Thread_local time_t last_min = -1;
+    static _Thread_local char last[32];
+    static _Thread_local size_t last_len;
+    time_t min = t >= 0 ? t / 60 : (t - 59) / 60;
+    if (min != last_min || !last_len) {
+        struct tm tmv;
+        struct tm *tm = localtime_r(&t, &tmv);
+        last_len = tm ? strftime(last, sizeof(last), "%b %d %H:%M", tm) : 0;
+        last_min = min;
+    }
+    memcpy(buf, last, last_len);
+    return last_len;
+}
+
+void print_file_details(struct outbuf *ob, const struct ls_entry *e) {
+    if (e->stat_err) {
+        report_error("stat", e->stat_err);
+        return;
+    }
+    const struct stat *st = &e->st;
+    char buf[32];
+    const char *name;
+    size_t n;
 
-    char timebuf[64];
-    struct tm *t = localtime(&st.st_mtime);
-    strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", t);
-    printf(" %s ", timebuf);
+    print_prefix(ob, e);
+    print_permissions(ob, st->st_mode);
+    ob_putc(ob, ' ');
+    ob_field(ob, buf, fmt_num(buf, (uint64_t)st->st_nlink, 0), widths.nlink);
+    ob_putc(ob, ' ');
+    n = id_text(0, (unsigned)st->st_uid, &name);
+    ob_write(ob, name, n);
+    ob_pad(ob, widths.user - (int)n + 1);
+    n = id_text(1, (unsigned)st->st_gid, &name);
+    ob_write(ob, name, n);
+    ob_pad(ob, widths.group - (int)n + 1);
+    ob_field(ob, buf, fmt_num(buf, (uint64_t)st->st_size, human_flag), widths.size);
+    ob_putc(ob, ' ');
+    ob_write(ob, buf, fmt_mtime(buf, st->st_mtime));
+    ob_putc(ob, ' ');
 
     /* colorized name */
-    print_colored_name_no_pad(".", filename);
-    putchar('\n');
+    print_colored_name_no_pad(ob, e);
+    ob_putc(ob, '\n');
 }
 
 /* ---------- permission printing ---------- */
-void print_permissions(mode_t mode) {
+void print_permissions(struct outbuf *ob, mode_t mode) {
     char perms[11];
     perms[0] = S_ISDIR(mode) ? 'd' :
                S_ISLNK(mode) ? 'l' :
@@ -380,5 +2610,5 @@ void print_permissions(mode_t mode) {
     perms[9] = (mode & S_IXOTH) ? 'x' : '-';
     perms[10] = '\0';
 
-    printf("%s", perms);
+    ob_write(ob, perms, 10);
 }
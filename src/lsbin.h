@@ -0,0 +1,173 @@
+/*
+ * lsbin.h - layout of `ls --format=bin` output and a zero-copy reader.
+ *
+ * The stream is a file header followed by one block per listed directory.
+ * Integers are in the writer's native byte order; the reader rejects
+ * nothing on that basis, so read on the same architecture. Every block
+ * is a multiple of 8 bytes and every column is aligned for its element
+ * type, so a reader that mmaps the file can use the column arrays in
+ * place:
+ *
+ *   struct lsbin_block           fixed header
+ *   char path[path_len]          directory path, padded to 8
+ *   uint64_t ino[count]          d_ino, set even where err[i] != 0
+ *   uint64_t size[count]         the other metadata columns are 0 there
+ *   int64_t  mtime_ns[count]
+ *   uint32_t mode[count]
+ *   uint32_t uid[count]
+ *   uint32_t gid[count]
+ *   uint32_t nlink[count]
+ *   int32_t  err[count]          errno from stat, 0 on success
+ *   uint32_t name_off[count + 1] offsets into names; name i is
+ *                                names[name_off[i] .. name_off[i+1]-1),
+ *                                NUL-terminated inside that range
+ *   (padding to 8)
+ *   char names[names_len]        padded to 8
+ *
+ * A directory that could not be read is a block with count 0 and
+ * dir_err set.
+ *
+ * Usage:
+ *
+ *   struct lsbin_file f;
+ *   struct lsbin_dir d;
+ *   if (lsbin_open(&f, "listing.bin") == 0) {
+ *       while (lsbin_next(&f, &d) > 0)
+ *           for (uint32_t i = 0; i < d.count; ++i)
+ *               puts(lsbin_name(&d, i));
+ *       lsbin_close(&f);
+ *   }
+ */
+#ifndef LSBIN_H
+#define LSBIN_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LSBIN_MAGIC         "LSB1"
+#define LSBIN_VERSION       1
+#define LSBIN_BLOCK_MAGIC   0x4b4c4244u     /* "DBLK" */
+
+struct lsbin_header {
+    char magic[4];
+    uint32_t version;
+};
+
+struct lsbin_block {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t block_len;         /* whole block including this header */
+    uint32_t path_len;          /* without padding or NUL */
+    uint32_t names_len;         /* without padding */
+    int32_t dir_err;
+    uint32_t pad;
+};
+
+#define LSBIN_ALIGN(n)  (((n) + 7) & ~(uint64_t)7)
+
+/* bytes a block with these sizes occupies */
+static inline uint64_t lsbin_block_size(uint32_t count, uint32_t path_len, uint32_t names_len) {
+    return sizeof(struct lsbin_block) + LSBIN_ALIGN(path_len)
+         + (uint64_t)count * 3 * 8
+         + LSBIN_ALIGN(((uint64_t)count * 6 + 1) * 4)
+         + LSBIN_ALIGN(names_len);
+}
+
+/* ---------- reader ---------- */
+
+struct lsbin_file {
+    const unsigned char *map;
+    size_t len, pos;
+};
+
+struct lsbin_dir {
+    const char *path;
+    uint32_t path_len, count;
+    int32_t dir_err;
+    const uint64_t *ino, *size;
+    const int64_t *mtime_ns;
+    const uint32_t *mode, *uid, *gid, *nlink;
+    const int32_t *err;
+    const uint32_t *name_off;
+    const char *names;
+};
+
+/* 0 on success, -1 with errno set */
+static inline int lsbin_open(struct lsbin_file *f, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct lsbin_header)) {
+        close(fd);
+        return -1;
+    }
+    void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    const struct lsbin_header *h = (const struct lsbin_header *)m;
+    if (memcmp(h->magic, LSBIN_MAGIC, 4) != 0 || h->version != LSBIN_VERSION) {
+        munmap(m, (size_t)st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    f->map = (const unsigned char *)m;
+    f->len = (size_t)st.st_size;
+    f->pos = LSBIN_ALIGN(sizeof(struct lsbin_header));
+    return 0;
+}
+
+static inline void lsbin_close(struct lsbin_file *f) {
+    if (f->map) munmap((void *)f->map, f->len);
+    f->map = NULL;
+}
+
+/*
+ * 1 with d filled, 0 at end of stream, -1 on a malformed block. The name
+ * offsets are checked once here (increasing, inside the blob, each name
+ * NUL-terminated), so lsbin_name needs no checks of its own.
+ */
+static inline int lsbin_next(struct lsbin_file *f, struct lsbin_dir *d) {
+    if (f->pos == f->len) return 0;
+    if (f->len - f->pos < sizeof(struct lsbin_block)) return -1;
+    const struct lsbin_block *b = (const struct lsbin_block *)(f->map + f->pos);
+    if (b->magic != LSBIN_BLOCK_MAGIC || b->block_len > f->len - f->pos
+        || b->block_len != lsbin_block_size(b->count, b->path_len, b->names_len))
+        return -1;
+    const unsigned char *p = (const unsigned char *)(b + 1);
+    uint32_t n = b->count;
+    d->path = (const char *)p;
+    d->path_len = b->path_len;
+    d->count = n;
+    d->dir_err = b->dir_err;
+    p += LSBIN_ALIGN(b->path_len);
+    d->ino = (const uint64_t *)p;       p += (size_t)n * 8;
+    d->size = (const uint64_t *)p;      p += (size_t)n * 8;
+    d->mtime_ns = (const int64_t *)p;   p += (size_t)n * 8;
+    d->mode = (const uint32_t *)p;      p += (size_t)n * 4;
+    d->uid = (const uint32_t *)p;       p += (size_t)n * 4;
+    d->gid = (const uint32_t *)p;       p += (size_t)n * 4;
+    d->nlink = (const uint32_t *)p;     p += (size_t)n * 4;
+    d->err = (const int32_t *)p;        p += (size_t)n * 4;
+    d->name_off = (const uint32_t *)p;
+    d->names = (const char *)(b + 1) + LSBIN_ALIGN(b->path_len) + (size_t)n * 3 * 8
+             + LSBIN_ALIGN(((size_t)n * 6 + 1) * 4);
+    if (d->name_off[0] != 0 || d->name_off[n] > b->names_len) return -1;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (d->name_off[i + 1] <= d->name_off[i] || d->names[d->name_off[i + 1] - 1] != '\0')
+            return -1;
+    }
+    f->pos += b->block_len;
+    return 1;
+}
+
+static inline const char *lsbin_name(const struct lsbin_dir *d, uint32_t i) {
+    return d->names + d->name_off[i];
+}
+
+#endif /* LSBIN_H */